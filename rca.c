@@ -76,6 +76,8 @@ char licensetext[] = \
 #include <limits.h>
 #include <errno.h>
 #include <locale.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <mpdecimal.h>
 
@@ -136,8 +138,10 @@ char *progname;
 void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [ commands ]\n", progname);
+	fprintf(stderr, "usage: %s [ --state file ] [ --proto ] [ commands ]\n", progname);
 	fprintf(stderr, "  'commands' will be used as initial program input\n");
+	fprintf(stderr, "  '--state' restores a state written by \"save\"\n");
+	fprintf(stderr, "  '--proto' answers each input line with one framed line\n");
 	fprintf(stderr, "  Use \"%s help\" for documentation.\n", progname);
 	exit(1);
 }
@@ -170,22 +174,38 @@ int g_argc;
 char **g_argv;
 
 const mpd_t *pi, *two_pi, *pi_over_2, *e, *NaN, *Inf,
-	*zero, *one, *two, *point3, *ninety, *oneeighty;
+	*zero, *one, *two, *point3, *ninety, *oneeighty, *hundred;
 
 /* internal representation of operands on the stack.
  * numbers are always stored as mpdecimals, even when we're in integer
- * mode.  */
-struct num {
+ * mode.  the lists are shared:  a snapshot or an undo checkpoint is
+ * just another reference to some node of the stack, so a node's refs
+ * counts the stack heads and the nodes above that point to it.  a
+ * shared node is never changed.  the values are shared as well:  a
+ * reordered stack is made of new nodes pointing at the old values, so
+ * a value's refs counts the nodes that point to it.  a shared value
+ * is copied before it's changed, and popping it pops a copy.  */
+struct val {
 	mpd_t *mpd;
+	int refs;
+	char *shown;	// formatted, as last displayed, or 0
+	int shown_mode;	// ... in this display mode,
+	long shown_gen;	// ... with these display settings
+};
+
+struct num {
+	struct val *val;
 	struct num *next;
+	int refs;
 };
 
 /* the operand stack */
 struct num *stack;
 int stack_count;
 
-/* the snapshot stack */
+/* the snapshot:  the top snapcount entries of the list at snapstack */
 struct num *snapstack;
+int snapcount;
 
 /* for command repeat, like "sum" */
 int stack_mark;
@@ -211,6 +231,10 @@ typedef struct oper {
 /* operator table */
 struct oper opers[];
 
+/* the operator being run.  user defined functions all share one
+ * opfunc, and this tells it which one it is.  */
+oper *invoked_oper;
+
 /* values for # of operands field in opers table:
  *  1 and 2 are used verbatim as operand counts
  *  0 denotes a pseudo-op, i.e. printing, configuration, or similar
@@ -224,12 +248,13 @@ struct oper opers[];
 typedef struct token {
 	int type;
 	mpd_t *mpd;    /* NUMERIC: malloc'ed libmpdecimal number */
-	char *valstr;  /* malloc'ed string value for NUMERIC and VARIABLE */
+	char *valstr;  /* scratch string value for NUMERIC and VARIABLE */
 	oper *oper;    /* OP or SYMBOLIC points into opers table */
 	char *str;     /* UNKNOWN: points to input buffer, for errors */
-	int imode;	    /* input mode: if NUMERIC, how was it entered?  */
+	int imode;	    /* input mode: if NUMERIC, how was it entered? (0 if folded) */
 	struct token *next; /* for stacking tokens when infix processing */
 	int alloced;   /* don't free this.  it wasn't alloc'ed */
+	int slot;      /* TEMPSTORE, TEMPLOAD: which hidden temporary */
 } token;
 
 /* values for token type */
@@ -239,6 +264,8 @@ typedef struct token {
 #define OP       'O'
 #define EOL      'E'
 #define VARIABLE 'V'
+#define TEMPSTORE 'T'  /* infix only: save x in a hidden temporary */
+#define TEMPLOAD  't'  /* infix only: push a hidden temporary */
 
 
 /* 5 major modes:  float, decimal, hex, octal, and binary.  all but
@@ -250,9 +277,25 @@ boolean floating_mode(int m) { return (m == 'F' || m == 'C' || m == 'M'); }
 /* if true, exit(4) on error, warning, or access to empty operand stack */
 boolean exit_on_error = FALSE;
 
+/* while folding constants in infix expressions, errors aren't
+ * reported, just counted.  */
+boolean suppress_errors = FALSE;
+int suppressed_errors;
+
+/* every error or warning, reported or not */
+long error_count;
+
 /* true, to copy stdin to stdout when it comes from a file or pipe */
 boolean echo_enabled = FALSE;
 
+/* "--proto" mode:  every input line starts with a request id, and is
+ * answered with exactly one line.  proto_id is the id of the request
+ * being worked on, and proto_error the first error it caused.  */
+boolean proto_mode = FALSE;
+char *proto_id;
+char *proto_error;
+FILE *proto_out;  // the real stdout.  stdout itself goes to /dev/null
+
 /* if non-zero, print that many entries from the top of stack after
  * any line that ends with an operator */
 int autoprint = 1;
@@ -275,6 +318,12 @@ boolean infix_mode = FALSE;
  * grouping information, we will decorate numbers, like "1,333,444" */
 boolean digitseparators = TRUE;
 
+/* machine-readable output:  if one of these is set, printed values
+ * are written as JSON or CSV rather than for people.  1 gives values
+ * as they'd be displayed, 2 gives them with full precision.  */
+int json_output = 0;
+int csv_output = 0;
+
 /* if true, debug mode is enabled, which enables a couple more
  * commands, and some more output in one or two places.  */
 boolean debug_enabled = FALSE;
@@ -315,8 +364,10 @@ int max_digits = USERDIGITS;  // may be overridden by $RCA_DIGITS
  * being prepared for display.  we add 50% for grouping separators
  * (the actual need is really only about 33%), and another 100 to be
  * sure we have a minimum for 64 bit integers, which also have
- * separators, and are displayed in various bases.  */
-#define TEMP_BUFSIZE ((size_t)(max_digits + max_digits/2) + 100)
+ * separators, and are displayed in various bases.  the widest
+ * integers need more:  a 4096 bit integer has 1234 decimal digits,
+ * each group of which may get a multi-byte separator.  */
+#define TEMP_BUFSIZE ((size_t)(max_digits + max_digits/2) + 100 + MAX_INT_WIDTH)
 long int temp_buf_hiwater;
 
 /* float_digits may represent either the total displayed precision, or
@@ -333,6 +384,13 @@ long long int_sign_bit;
 long long int_mask = ~0;
 #define LONGLONG_BITS (sizeof(long long) * 8)
 
+/* integers wider than 64 bits are operated on, bitwise, as arrays of
+ * 64-bit "limbs", least significant first.  int_mask and int_sign_bit
+ * above are only meaningful for widths of 64 bits or less.  */
+#define MAX_INT_WIDTH 4096
+#define MAX_LIMBS (MAX_INT_WIDTH / 64)
+int int_limbs;		/* number of limbs needed for int_width bits */
+
 /* these are filled in from the locale, if possible, otherwise
  * they'll default to period, comma, and dollar-sign.  none will
  * be a null pointer after locale_init() has run. */
@@ -373,8 +431,8 @@ void putback_token(token *t);
  * mpdecimal operand operators, and 1 and 2 bitwise operand operators. */
 typedef void (*mpd_1_op_func_t)(mpd_t *, const mpd_t *, mpd_context_t *);
 typedef void (*mpd_2_op_func_t)(mpd_t *, const mpd_t *, const mpd_t *, mpd_context_t *);
-typedef void (*bitwise_2_op_func_t)(uint64_t *, uint64_t, uint64_t);
-typedef void (*bitwise_1_op_func_t)(uint64_t *, uint64_t);
+typedef void (*bitwise_2_op_func_t)(uint64_t *, const uint64_t *, const uint64_t *, int);
+typedef void (*bitwise_1_op_func_t)(uint64_t *, const uint64_t *, int);
 
 void p_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 void error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
@@ -429,9 +487,253 @@ safe_calloc(size_t size)
        return p;
 }
 
+/* nearly all allocations come from mpdecimal, for numbers and their
+ * coefficients.  most are small, and they come and go with every
+ * operation, so rather than returning small blocks to malloc we keep
+ * them on free lists by size.  each block is preceded by a header
+ * holding its size class, so that free and realloc can find its list.
+ * these are installed as mpdecimal's allocation hooks at startup, so
+ * anything mpdecimal allocates (including mpd_to_sci() strings) must
+ * be given back with mpd_free(), not free().  */
+#define POOL_GRAIN 16
+#define POOL_CLASSES 32		// blocks up to 512 bytes are pooled
+
+union pool_header {
+	size_t class;		// size in grains.  pooled if <= POOL_CLASSES
+	union pool_header *next;	// while on a free list
+	long double align;
+};
+
+union pool_header *pool_lists[POOL_CLASSES + 1];
+
+struct {
+	long mallocs;		// blocks that came from malloc()
+	long reuses;		// blocks that came from a free list
+	long frees;
+	long reallocs;
+	long inuse;		// bytes
+	long hiwater;
+} pool_stats;
+
+void *
+pool_malloc(size_t size)
+{
+	union pool_header *h;
+	size_t class = (size + POOL_GRAIN - 1) / POOL_GRAIN;
+
+	if (class == 0)
+		class = 1;
+
+	if (class <= POOL_CLASSES && (h = pool_lists[class])) {
+		pool_lists[class] = h->next;
+		pool_stats.reuses++;
+	} else {
+		h = (union pool_header *)malloc(sizeof(*h) + class * POOL_GRAIN);
+		if (!h)
+			return NULL;	// mpdecimal reports this itself
+		pool_stats.mallocs++;
+	}
+	h->class = class;
+
+	pool_stats.inuse += (long)(class * POOL_GRAIN);
+	if (pool_stats.inuse > pool_stats.hiwater)
+		pool_stats.hiwater = pool_stats.inuse;
+
+	return h + 1;
+}
+
+void
+pool_free(void *p)
+{
+	union pool_header *h;
+	size_t class;
+
+	if (!p)
+		return;
+
+	h = (union pool_header *)p - 1;
+	class = h->class;
+	pool_stats.frees++;
+	pool_stats.inuse -= (long)(class * POOL_GRAIN);
+
+	if (class > POOL_CLASSES) {
+		free(h);
+		return;
+	}
+	h->next = pool_lists[class];
+	pool_lists[class] = h;
+}
+
+void *
+pool_calloc(size_t nmemb, size_t size)
+{
+	void *p;
+
+	if (size && nmemb > SIZE_MAX / size)
+		return NULL;
+	if ((p = pool_malloc(nmemb * size)))
+		memset(p, 0, nmemb * size);
+	return p;
+}
+
+void *
+pool_realloc(void *p, size_t size)
+{
+	union pool_header *h;
+	size_t class, newclass;
+	void *np;
+
+	if (!p)
+		return pool_malloc(size);
+
+	h = (union pool_header *)p - 1;
+	class = h->class;
+	newclass = (size + POOL_GRAIN - 1) / POOL_GRAIN;
+	pool_stats.reallocs++;
+
+	// mpdecimal shrinks results after most operations:  keep the block
+	if (newclass <= class && class <= POOL_CLASSES)
+		return p;
+
+	if (class > POOL_CLASSES && newclass > POOL_CLASSES) {
+		h = (union pool_header *)realloc(h,
+				sizeof(*h) + newclass * POOL_GRAIN);
+		if (!h)
+			return NULL;
+		h->class = newclass;
+		pool_stats.inuse += (long)((newclass - class) * POOL_GRAIN);
+		if (pool_stats.inuse > pool_stats.hiwater)
+			pool_stats.hiwater = pool_stats.inuse;
+		return h + 1;
+	}
+
+	if (!(np = pool_malloc(size)))
+		return NULL;
+	memcpy(np, p, (class < newclass ? class : newclass) * POOL_GRAIN);
+	pool_free(p);
+	return np;
+}
+
+void
+pool_install(void)
+{
+#ifdef DO_VALGRIND_CHECKS
+	/* blocks waiting on a free list would hide use-after-free
+	 * and overruns from valgrind */
+	if (RUNNING_ON_VALGRIND)
+		return;
+#endif
+	mpd_mallocfunc = pool_malloc;
+	mpd_callocfunc = pool_calloc;
+	mpd_reallocfunc = pool_realloc;
+	mpd_free = pool_free;
+}
+
+/* scratch space, for arrays that are only needed while a command runs
+ * (e.g., to sort or select from the stack).  allocating is just a
+ * matter of bumping a pointer, nothing is freed individually, and the
+ * whole region is reset at the end of each input line.  */
+#define SCRATCH_CHUNK ((size_t)64 * 1024)
+
+struct scratch_chunk {
+	struct scratch_chunk *next;
+	size_t size, used;
+	long double data[];
+} *scratch;
+
+long scratch_allocs, scratch_hiwater;
+
+/* returns zero-filled space, or exits */
+void *
+scratch_alloc(size_t size)
+{
+	struct scratch_chunk *c = scratch;
+	void *p;
+
+	size = (size + sizeof(long double) - 1) & ~(sizeof(long double) - 1);
+
+	if (!c || c->size - c->used < size) {
+		size_t csize = size > SCRATCH_CHUNK ? size : SCRATCH_CHUNK;
+		c = (struct scratch_chunk *)malloc(sizeof(*c) + csize);
+		if (!c) memory_failure();
+		c->size = csize;
+		c->used = 0;
+		c->next = scratch;
+		scratch = c;
+	}
+
+	p = (char *)c->data + c->used;
+	c->used += size;
+	scratch_allocs++;
+	if ((long)c->used > scratch_hiwater)
+		scratch_hiwater = (long)c->used;
+
+	memset(p, 0, size);
+	return p;
+}
+
+char *
+scratch_strndup(const char *s, size_t n)
+{
+	char *p = (char *)scratch_alloc(n + 1);
+
+	return strncpy(p, s, n);
+}
+
+/* keep one ordinary sized chunk for the next line, free the rest */
+void
+scratch_reset(void)
+{
+	struct scratch_chunk *c, *keep = NULL;
+
+	while ((c = scratch)) {
+		scratch = c->next;
+		if (!keep && c->size == SCRATCH_CHUNK) {
+			keep = c;
+			keep->used = 0;
+			keep->next = NULL;
+		} else {
+			free(c);
+		}
+	}
+	scratch = keep;
+}
+
 void
 error(const char *fmt, ...)
 {
+	error_count++;
+
+	if (suppress_errors) {
+		suppressed_errors++;
+		return;
+	}
+
+	if (proto_mode && proto_id) {
+		// keep the first one, for the response
+		if (!proto_error) {
+			char buf[256], *p, *q;
+
+			va_list ap;
+			va_start(ap, fmt);
+			vsnprintf(buf, sizeof(buf), fmt, ap);
+			va_end(ap);
+
+			// one line, without the indentation
+			for (p = q = buf; *p; p++) {
+				if (*p == '\n')
+					*p = ' ';
+				if (*p != ' ' || (q != buf && q[-1] != ' '))
+					*q++ = *p;
+			}
+			while (q != buf && q[-1] == ' ')
+				q--;
+			*q = '\0';
+			proto_error = strdup(buf);
+		}
+		return;
+	}
+
 	fflush(stdout);
 
 	va_list ap;
@@ -452,8 +754,10 @@ void
 mpd_startup(void)
 {
 
+	/* a saved state brings its own precision with it */
+	extern void *state_map;
 	char *rdp = getenv("RCA_DIGITS");
-	if (rdp) {
+	if (rdp && !state_map) {
 		char *endp;
 		long digits = strtol(rdp, &endp, 10);
 		if (*endp == '\0') {
@@ -491,21 +795,25 @@ mpd_startup(void)
 	oneeighty = mpd_new(ctx);
 	mpd_set_string((mpd_t *)oneeighty, "180", ctx);
 
+	hundred = mpd_new(ctx);
+	mpd_set_string((mpd_t *)hundred, "100", ctx);
+
 	NaN = mpd_new(ctx);
 	mpd_set_string((mpd_t *)NaN, "NaN", ctx);
 
 	Inf = mpd_new(ctx);
 	mpd_set_string((mpd_t *)Inf, "Infinity", ctx);
 
-	e = mpd_new(ctx);
-	mpd_exp((mpd_t *)e, one, ctx);
-
-	{ // establish pi and its multiples
+	boolean state_constants(void);
+	if (!state_constants()) { // establish e, pi and its multiples
 		void mpd_atan(mpd_t *m, const mpd_t *ix, mpd_context_t *ctx);
 		extern int trig_degrees;
 		int save_degrees = trig_degrees;
 		trig_degrees = 0;  // definitely want radians for this
 
+		e = mpd_new(ctx);
+		mpd_exp((mpd_t *)e, one, ctx);
+
 		mpd_t *pi_over_4 = mpd_new(ctx);
 
 		int save_max_digits = max_digits;
@@ -543,24 +851,31 @@ mpd_startup(void)
 	ctx->prec -= 10;
 }
 
-unsigned long long
-mpd_get_64_bits(int *changed, mpd_t *n, mpd_t *m)
+/* reduce m to an integer, modulo the word width.  that value keeps
+ * the sign of m, and is copied to n if n is non-null.  the returned
+ * value is the same residue forced positive, i.e., it is the two's
+ * complement representation of m.  m must be finite.  */
+mpd_t *
+mpd_int_residue(int *changed, mpd_t *n, mpd_t *m)
 {
-	if (!mpd_isfinite(m)) {
-		mpd_copy(n, m, ctx);
-		if (changed) *changed = 0;
-		return 0;
-	}
-
 	static mpd_t *r, *t, *q;
+	mpd_context_t bigctx, *ic = ctx;
 	if (!r) {
 		r = mpd_new(ctx);
 		t = mpd_new(ctx);
 		q = mpd_new(ctx);
 	}
 
-	mpd_trunc(r, m, ctx); // remove fractional part
-	mpd_divmod(q, r, r, int_modulo, ctx); // modulo word-length
+	/* values left over from a wider word width, or very large
+	 * floating values, need more precision than we're using */
+	if (mpd_adjexp(m) >= ctx->prec) {
+		bigctx = *ctx;
+		bigctx.prec = mpd_adjexp(m) + 2;
+		ic = &bigctx;
+	}
+
+	mpd_trunc(r, m, ic); // remove fractional part
+	mpd_divmod(q, r, r, int_modulo, ic); // modulo word-length
 
 	mpd_copy(t, r, ctx);
 
@@ -571,7 +886,79 @@ mpd_get_64_bits(int *changed, mpd_t *n, mpd_t *m)
 	if (n) mpd_copy(n, t, ctx);
 	if (changed) *changed = (mpd_cmp(t, m, ctx) != 0);
 
-	return mpd_get_u64(r, ctx);
+	return r;
+}
+
+unsigned long long
+mpd_get_64_bits(int *changed, mpd_t *n, mpd_t *m)
+{
+	if (!mpd_isfinite(m)) {
+		mpd_copy(n, m, ctx);
+		if (changed) *changed = 0;
+		return 0;
+	}
+
+	return mpd_get_u64(mpd_int_residue(changed, n, m), ctx);
+}
+
+/* like mpd_get_64_bits(), but for any word width.  the two's
+ * complement bits of m are returned in nlimbs limbs, least
+ * significant first.  mpdecimal does the base conversion for us,
+ * 16 bits at a time.  */
+void
+mpd_get_limbs(uint64_t *l, int nlimbs, int *changed, mpd_t *n, mpd_t *m)
+{
+	uint16_t w[MAX_LIMBS * 4], *wp = w;
+	uint32_t status = 0;
+	size_t i, nw;
+	mpd_t *r;
+
+	memset(l, 0, (size_t)nlimbs * sizeof(*l));
+
+	if (!mpd_isfinite(m)) {
+		if (n) mpd_copy(n, m, ctx);
+		if (changed) *changed = 0;
+		return;
+	}
+
+	r = mpd_int_residue(changed, n, m);
+
+	if (int_limbs == 1) {
+		l[0] = mpd_get_u64(r, ctx);
+		return;
+	}
+
+	nw = mpd_qexport_u16(&wp, MAX_LIMBS * 4, 1 << 16, r, &status);
+	if (nw == SIZE_MAX) {
+		error(" BUG: mpd_get_limbs() export failed\n");
+		return;
+	}
+	for (i = 0; i < nw && i < (size_t)nlimbs * 4; i++)
+		l[i / 4] |= (uint64_t)w[i] << (16 * (i % 4));
+}
+
+/* the inverse of mpd_get_limbs():  set m from nlimbs limbs, taken
+ * as an unsigned value.  */
+void
+mpd_set_limbs(mpd_t *m, const uint64_t *l, int nlimbs)
+{
+	uint16_t w[MAX_LIMBS * 4];
+	uint32_t status = 0;
+	int i;
+
+	while (nlimbs > 1 && l[nlimbs - 1] == 0)
+		nlimbs--;
+
+	if (nlimbs == 1) {
+		mpd_set_u64(m, l[0], ctx);
+		return;
+	}
+
+	for (i = 0; i < nlimbs * 4; i++)
+		w[i] = (uint16_t)(l[i / 4] >> (16 * (i % 4)));
+
+	mpd_qimport_u16(m, w, (size_t)nlimbs * 4, MPD_POS, 1 << 16,
+			ctx, &status);
 }
 
 /* compare magnitude of number against the given threshold exponent */
@@ -591,6 +978,38 @@ mpd_mag_lessthan(const mpd_t *x, int exp)
 	return 0;
 }
 
+/* most values are small, so instead of mpd_new()'s separate
+ * allocations for the mpd_t and its coefficient, allocate both in a
+ * single block, with the coefficient marked as static data.  if a
+ * value outgrows INLINE_WORDS (76 digits), mpdecimal moves its
+ * coefficient to the heap on its own, and mpd_del() frees it.  */
+#define INLINE_WORDS 4
+struct inline_mpd {
+	mpd_t m;
+	mpd_uint_t data[INLINE_WORDS];
+};
+
+mpd_t *
+mpd_new_inline(void)
+{
+	struct inline_mpd *im;
+
+	if (MPD_MINALLOC > INLINE_WORDS)
+		return mpd_new(ctx);
+
+	im = (struct inline_mpd *)mpd_mallocfunc(sizeof(*im));
+	if (!im) memory_failure();
+
+	im->m.flags = MPD_STATIC_DATA;
+	im->m.exp = 0;
+	im->m.digits = 1;
+	im->m.len = 1;
+	im->m.alloc = INLINE_WORDS;
+	im->m.data = im->data;
+	im->data[0] = 0;
+	return &im->m;
+}
+
 /* useful for updating saved values.  free the old decimal, and copy
  * in the new one.  caller is still responsible for their copy. */
 void
@@ -601,7 +1020,7 @@ mpd_free_before_copy(mpd_t **resultp, const mpd_t *a, mpd_context_t *ctx)
 	    mpd_del(*resultp);
 	    *resultp = 0;
 	}
-	*resultp = mpd_new(ctx);
+	*resultp = mpd_new_inline();
 	// trace_mpd(EXEC, "copying", a);
 	mpd_copy(*resultp, a, ctx);
 }
@@ -612,137 +1031,472 @@ char *
 mpd(mpd_t *m)
 {
 	static char *s;
-	if (s) free(s);
+	if (s) mpd_free(s);
 	return s = mpd_to_sci(m, 0);
 }
 
-// ------------------------   basic stack operations
+/* get an integer argument (a count, or a setting).  fails if m isn't
+ * an integer, or won't fit in 64 bits.  */
+boolean
+mpd_get_count(const mpd_t *m, int64_t *n)
+{
+	uint32_t status = 0;
+
+	*n = mpd_qget_i64(m, &status);
+	return status == 0;
+}
 
+// ------------------------   currency arithmetic
+
+/* in currency mode every value is rounded to frac_digits decimal
+ * places, so it's just an integer count of minor units (e.g., cents).
+ * when the operands fit in 64 bits, we do the arithmetic on those
+ * integers directly, and fall back to mpdecimal when they don't, or
+ * when the result won't.  rounding is always half-even ("banker's
+ * rounding"), whichever way the answer is found.  */
+#ifdef __SIZEOF_INT128__
+__extension__ typedef __int128 cur_wide_t;
+#define HAVE_CURRENCY_ENGINE 1
+#endif
+
+/* round a value to currency precision */
 void
-mpush(mpd_t *a)
+currency_round(mpd_t *a)
 {
-	struct num *p;
-
-	if (!floating_mode(mode))
-		mpd_get_64_bits(0, a, a);
+	mpd_context_t cctx = *ctx;
 
-	p = (struct num *)safe_calloc(sizeof(struct num));
-	if (mode == 'C')
-		mpd_rescale(a, a, -frac_digits, ctx);
-	p->mpd = a;
-	p->next = stack;
-	stack = p;
-	stack_count++;
-	trace_mpd(EXEC, "mpushed", a);
+	cctx.round = MPD_ROUND_HALF_EVEN;
+	mpd_rescale(a, a, -frac_digits, &cctx);
 }
 
-void
-mpush_copy(const mpd_t *a)
+#ifdef HAVE_CURRENCY_ENGINE
+
+/* 10 to the frac_digits */
+int64_t
+cur_scale(void)
 {
-    mpd_t *n;
+	static const int64_t pow10[] = {
+		1, 10, 100, 1000, 10000, 100000, 1000000
+	};
 
-    n = mpd_new(ctx);
-    mpd_copy(n, a, ctx);
-    mpush(n);
+	if (frac_digits < 0 || frac_digits > 6)
+		return 0;
+	return pow10[frac_digits];
 }
 
+/* get m as a count of minor units, if it's a currency value that fits */
 boolean
-mpeek(mpd_t **f)
+cur_get(const mpd_t *m, int64_t *v)
 {
-	if (!stack)
+	if (mpd_isspecial(m) || m->exp != -frac_digits || m->len != 1 ||
+			m->data[0] > (mpd_uint_t)INT64_MAX)
 		return FALSE;
 
-	*f = stack->mpd;
-
+	*v = (int64_t)m->data[0];
+	if (mpd_isnegative(m))
+		*v = -*v;
 	return TRUE;
 }
 
-boolean
-mpeek2(mpd_t **f)
+void
+cur_set(mpd_t *m, int64_t v)
 {
-	if (!stack)
-		return FALSE;
+	mpd_set_i64(m, v, ctx);
+	m->exp = -frac_digits;
+}
 
-	if (!stack->next)
-		return FALSE;
+/* n / d, rounded half-even, if the result fits.  d must not be 0. */
+boolean
+cur_divround(cur_wide_t n, cur_wide_t d, int64_t *q)
+{
+	cur_wide_t w = n / d, r = n % d;
+	cur_wide_t r2 = (r < 0) ? -2 * r : 2 * r;
+	cur_wide_t ad = (d < 0) ? -d : d;
 
-	*f = stack->next->mpd;
+	if (r2 > ad || (r2 == ad && (w & 1)))
+		w += ((n < 0) != (d < 0)) ? -1 : 1;
 
+	if (w > INT64_MAX || w < INT64_MIN)
+		return FALSE;
+	*q = (int64_t)w;
 	return TRUE;
 }
 
+/* r = y f x, for the four basic operators, if it can be done natively */
 boolean
-mpop(mpd_t **a)
+currency_op(mpd_2_op_func_t f, mpd_t *r, const mpd_t *y, const mpd_t *x)
 {
+	int64_t a, b, c, scale = cur_scale();
 
-	struct num *p = stack;
-	if (!p) {
-		error(" empty stack\n");
+	if (!scale || !cur_get(y, &a) || !cur_get(x, &b))
 		return FALSE;
-	}
-	*a = p->mpd;
-	stack = p->next;
-	trace_mpd(EXEC, " mpopped", p->mpd);
-	free(p);
-	stack_count--;
 
-	if (stack_count < infix_stacklevel) {
-		error("BUG: stack level dropped by %d during infix\n",
-				infix_stacklevel - stack_count);
+	if (f == mpd_add) {
+		if (__builtin_add_overflow(a, b, &c))
+			return FALSE;
+	} else if (f == mpd_sub) {
+		if (__builtin_sub_overflow(a, b, &c))
+			return FALSE;
+	} else if (f == mpd_mul) {
+		if (!cur_divround((cur_wide_t)a * b, scale, &c))
+			return FALSE;
+	} else if (f == mpd_div) {
+		if (b == 0 || !cur_divround((cur_wide_t)a * scale, b, &c))
+			return FALSE;
+	} else {
+		return FALSE;
 	}
+	cur_set(r, c);
+	return TRUE;
+}
 
-	/* remove a stack mark if we've gone below it */
-	if (stack_count < stack_mark)
-		stack_mark = 0;
+/* the percent operators:  y * x / 100, y plus or minus that, or the
+ * percent difference between them */
+boolean
+currency_percent(int which, mpd_t *r, const mpd_t *y, const mpd_t *x)
+{
+	int64_t a, b, c, scale = cur_scale();
+	cur_wide_t hs = (cur_wide_t)scale * 100;
 
+	if (!scale || !cur_get(y, &a) || !cur_get(x, &b))
+		return FALSE;
+
+	switch (which) {
+	case '?':	// (x - y) * 100 / y
+		if (a == 0 || !cur_divround(((cur_wide_t)b - a) * hs, a, &c))
+			return FALSE;
+		break;
+	case '+':
+		if (!cur_divround((cur_wide_t)a * hs + (cur_wide_t)a * b, hs, &c))
+			return FALSE;
+		break;
+	case '-':
+		if (!cur_divround((cur_wide_t)a * hs - (cur_wide_t)a * b, hs, &c))
+			return FALSE;
+		break;
+	default:
+		if (!cur_divround((cur_wide_t)a * b, hs, &c))
+			return FALSE;
+		break;
+	}
+	cur_set(r, c);
 	return TRUE;
 }
 
-// ------------------------   "lastx" management
+#else
 
-void
-set_lastx(mpd_t *a)
+boolean
+currency_op(mpd_2_op_func_t f, mpd_t *r, const mpd_t *y, const mpd_t *x)
 {
-	trace_mpd(EXEC, "lx is now", a);
-	mpd_free_before_copy(&lastx, a, ctx);
+	(void)f; (void)r; (void)y; (void)x;
+	return FALSE;
 }
 
-void
-set_lasty(mpd_t *a)
+boolean
+currency_percent(int which, mpd_t *r, const mpd_t *y, const mpd_t *x)
 {
-	trace_mpd(EXEC, "ly is now", a);
-	mpd_free_before_copy(&lasty, a, ctx);
+	(void)which; (void)r; (void)y; (void)x;
+	return FALSE;
 }
 
-// during an infix evaluation, lastx needs to kept at its pre-infix value.
-boolean lastx_is_frozen = 0;
+#endif
 
-void
-freeze_lastx(void)
+// ------------------------   basic stack operations
+
+/* stack entries come and go constantly, so their nodes are kept on a
+ * free list rather than going back to the allocator */
+struct num *num_freelist;
+
+struct num *
+num_alloc(void)
 {
-	if (!lastx_is_frozen) {
-		mpd_t *x;
-		if (mpeek(&x))
-			mpd_free_before_copy(&frozen_lastx, x, ctx);
-		if (mpeek2(&x))
-			mpd_free_before_copy(&frozen_lasty, x, ctx);
-		lastx_is_frozen = TRUE;
-		infix_stacklevel = stack_count;
+	struct num *p;
+
+	if ((p = num_freelist)) {
+		num_freelist = p->next;
+		p->next = NULL;
+		return p;
 	}
+	return (struct num *)safe_calloc(sizeof(struct num));
 }
 
 void
-thaw_lastx(void)
+num_free(struct num *p)
 {
-	if (lastx_is_frozen) {
-		lastx_is_frozen = FALSE;
-		if (frozen_lastx)
-			set_lastx(frozen_lastx);
-		if (frozen_lasty)
-			set_lasty(frozen_lasty);
-		mpd_copy(frozen_lastx, zero, ctx);
-		mpd_copy(frozen_lasty, zero, ctx);
-		// infix must add either no or 1 value to the stack
+	p->val = NULL;
+	p->next = num_freelist;
+	num_freelist = p;
+}
+
+/* discard an entry's saved display string */
+void
+num_forget(struct num *p)
+{
+	mpd_free(p->val->shown);
+	p->val->shown = NULL;
+}
+
+struct val *
+val_new(mpd_t *a)
+{
+	struct val *v;
+
+	v = (struct val *)mpd_mallocfunc(sizeof(*v));
+	if (!v) memory_failure();
+	v->mpd = a;
+	v->refs = 1;
+	v->shown = NULL;
+	return v;
+}
+
+/* drop a reference to a value, and return a number of the caller's
+ * own:  the value itself, if that was the last reference, or else a
+ * copy of it.  */
+mpd_t *
+val_take(struct val *v)
+{
+	mpd_t *a;
+
+	if (--v->refs > 0) {
+		a = mpd_new_inline();
+		mpd_copy(a, v->mpd, ctx);
+		return a;
+	}
+	a = v->mpd;
+	mpd_free(v->shown);
+	mpd_free(v);
+	return a;
+}
+
+void
+val_release(struct val *v)
+{
+	if (v->refs == 1)
+		mpd_del(val_take(v));
+	else
+		v->refs--;
+}
+
+void
+num_hold(struct num *p)
+{
+	if (p)
+		p->refs++;
+}
+
+/* drop a reference to a list, freeing the nodes nothing else uses */
+void
+num_release(struct num *p)
+{
+	struct num *next;
+
+	while (p && --p->refs == 0) {
+		next = p->next;
+		val_release(p->val);
+		num_free(p);
+		p = next;
+	}
+}
+
+/* make sure none of the top n nodes of the stack are shared, by
+ * copying any that are, so they can be relinked in place.  everything
+ * under a shared node is shared too.  the copies point at the same
+ * values:  one that's going to be changed needs num_own_value().  */
+void
+stack_own(int n)
+{
+	struct num **pp = &stack, *p, *np;
+
+	while (n-- > 0 && (p = *pp)) {
+		if (p->refs > 1) {
+			np = num_alloc();
+			np->refs = 1;
+			np->val = p->val;
+			np->val->refs++;
+			np->next = p->next;
+			num_hold(p->next);
+			p->refs--;
+			*pp = p = np;
+		}
+		pp = &p->next;
+	}
+}
+
+/* make the value of p, a node that isn't shared, its own, copying it
+ * if need be, so that it can be changed in place */
+mpd_t *
+num_own_value(struct num *p)
+{
+	mpd_t *a;
+
+	if (p->val->refs > 1) {
+		a = mpd_new_inline();
+		mpd_copy(a, p->val->mpd, ctx);
+		p->val->refs--;
+		p->val = val_new(a);
+	}
+	return p->val->mpd;
+}
+
+void
+mpush(mpd_t *a)
+{
+	struct num *p;
+
+	if (!floating_mode(mode))
+		mpd_get_64_bits(0, a, a);
+
+	p = num_alloc();
+	if (mode == 'C' && (mpd_isspecial(a) || a->exp != -frac_digits))
+		currency_round(a);
+	p->val = val_new(a);
+	p->next = stack;
+	p->refs = 1;
+	stack = p;
+	stack_count++;
+	trace_mpd(EXEC, "mpushed", a);
+}
+
+void
+mpush_copy(const mpd_t *a)
+{
+    mpd_t *n;
+
+    n = mpd_new_inline();
+    mpd_copy(n, a, ctx);
+    mpush(n);
+}
+
+boolean
+mpeek(mpd_t **f)
+{
+	if (!stack)
+		return FALSE;
+
+	*f = stack->val->mpd;
+
+	return TRUE;
+}
+
+boolean
+mpeek2(mpd_t **f)
+{
+	if (!stack)
+		return FALSE;
+
+	if (!stack->next)
+		return FALSE;
+
+	*f = stack->next->val->mpd;
+
+	return TRUE;
+}
+
+boolean
+mpop(mpd_t **a)
+{
+
+	struct num *p = stack;
+	if (!p) {
+		error(" empty stack\n");
+		return FALSE;
+	}
+	trace_mpd(EXEC, " mpopped", p->val->mpd);
+	stack = p->next;
+	if (p->refs == 1) {	// our node:  take its value
+		*a = val_take(p->val);
+		num_free(p);
+	} else {		// shared:  leave it be, and copy
+		p->refs--;
+		num_hold(p->next);
+		*a = mpd_new_inline();
+		mpd_copy(*a, p->val->mpd, ctx);
+	}
+	stack_count--;
+
+	if (stack_count < infix_stacklevel) {
+		error("BUG: stack level dropped by %d during infix\n",
+				infix_stacklevel - stack_count);
+	}
+
+	/* remove a stack mark if we've gone below it */
+	if (stack_count < stack_mark)
+		stack_mark = 0;
+
+	return TRUE;
+}
+
+// ------------------------   "lastx" management
+
+/* lastx and lasty keep their storage, and are copied into, so
+ * remembering an operand doesn't allocate unless it's grown.  */
+void
+set_lastx(mpd_t *a)
+{
+	trace_mpd(EXEC, "lx is now", a);
+	mpd_copy(lastx, a, ctx);
+}
+
+void
+set_lasty(mpd_t *a)
+{
+	trace_mpd(EXEC, "ly is now", a);
+	mpd_copy(lasty, a, ctx);
+}
+
+/* for operands that were popped, and aren't needed afterward:  they
+ * become lastx and lasty themselves, rather than being copied.  the
+ * old lastx or lasty is handed back, for reuse as a result, or to be
+ * freed in place of the operand.  */
+mpd_t *
+move_lastx(mpd_t *a)
+{
+	mpd_t *old = lastx;
+
+	trace_mpd(EXEC, "lx is now", a);
+	lastx = a;
+	return old;
+}
+
+mpd_t *
+move_lasty(mpd_t *a)
+{
+	mpd_t *old = lasty;
+
+	trace_mpd(EXEC, "ly is now", a);
+	lasty = a;
+	return old;
+}
+
+// during an infix evaluation, lastx needs to kept at its pre-infix value.
+boolean lastx_is_frozen = 0;
+
+void
+freeze_lastx(void)
+{
+	if (!lastx_is_frozen) {
+		mpd_t *x;
+		if (mpeek(&x))
+			mpd_copy(frozen_lastx, x, ctx);
+		if (mpeek2(&x))
+			mpd_copy(frozen_lasty, x, ctx);
+		lastx_is_frozen = TRUE;
+		infix_stacklevel = stack_count;
+	}
+}
+
+void
+thaw_lastx(void)
+{
+	if (lastx_is_frozen) {
+		lastx_is_frozen = FALSE;
+		if (frozen_lastx)
+			set_lastx(frozen_lastx);
+		if (frozen_lasty)
+			set_lasty(frozen_lasty);
+		mpd_copy(frozen_lastx, zero, ctx);
+		mpd_copy(frozen_lasty, zero, ctx);
+		// infix must add either no or 1 value to the stack
 		int i = stack_count - infix_stacklevel;
 		if (i != 0 && i != 1)
 			error("BUG: stack changed by %d after infix\n",
@@ -807,11 +1561,26 @@ mpd_bothfinite(mpd_t *x, mpd_t *y)
 	return 1;
 }
 
+int
+bitwise_width(void)
+{
+	if (floating_mode(mode) && int_width < (int)LONGLONG_BITS)
+		return LONGLONG_BITS;
+	return int_width;
+}
+
+int
+bitwise_limbs(void)
+{
+	return (bitwise_width() + 63) / 64;
+}
+
 opreturn
 bitwise_2_op_shell(char *which, bitwise_2_op_func_t f, int checkdistance)
 {
 	mpd_t *mx, *my;
-	uint64_t x, y, r;
+	uint64_t x[MAX_LIMBS], y[MAX_LIMBS], r[MAX_LIMBS];
+	int nlimbs;
 
 	if (!mpop(&mx))
 		return BADOP;
@@ -833,44 +1602,109 @@ bitwise_2_op_shell(char *which, bitwise_2_op_func_t f, int checkdistance)
 		return BADOP;
 	}
 
-	set_lastx(mx);
 	set_lasty(my);
 
-	y = mpd_get_64_bits(0, 0, my);
-	x = mpd_get_64_bits(0, 0, mx);
+	nlimbs = bitwise_limbs();
+	mpd_get_limbs(y, nlimbs, 0, 0, my);
+	mpd_get_limbs(x, nlimbs, 0, 0, mx);
 
-	f(&r, y, x);
+	f(r, y, x, nlimbs);
 
-	mpd_set_u64(my, r, ctx);
+	mpd_set_limbs(my, r, nlimbs);
 
 	mpush(my);
-	mpd_del(mx);
+	mpd_del(move_lastx(mx));
 
 	return GOODOP;
 }
 
 
-int
-bitwise_width(void)
+/* clear all bits at or above "bits" */
+void
+limbs_mask(uint64_t *u, int nlimbs, int bits)
 {
-	return floating_mode(mode) ? 64 : int_width;
+	int i;
+
+	for (i = 0; i < nlimbs; i++) {
+		if (64 * i >= bits)
+			u[i] = 0;
+		else if (bits - 64 * i < 64)
+			u[i] &= (1ULL << (bits - 64 * i)) - 1;
+	}
 }
 
 void
-rshift_worker(uint64_t *r, uint64_t y, uint64_t x)
+limbs_shl(uint64_t *r, const uint64_t *a, uint64_t count, int nlimbs)
 {
-	if (x >= (uint64_t)bitwise_width()) {
-		*r = 0;
-	} else {
-		uint64_t i = x;
-		uint64_t j = y;
+	int w = (int)(count / 64), b = (int)(count % 64), i;
+
+	for (i = nlimbs - 1; i >= 0; i--) {
+		uint64_t v = 0;
+		if (i - w >= 0) {
+			v = a[i - w] << b;
+			if (b && i - w - 1 >= 0)
+				v |= a[i - w - 1] >> (64 - b);
+		}
+		r[i] = v;
+	}
+}
+
+void
+limbs_shr(uint64_t *r, const uint64_t *a, uint64_t count, int nlimbs)
+{
+	int w = (int)(count / 64), b = (int)(count % 64), i;
+
+	for (i = 0; i < nlimbs; i++) {
+		uint64_t v = 0;
+		if (i + w < nlimbs) {
+			v = a[i + w] >> b;
+			if (b && i + w + 1 < nlimbs)
+				v |= a[i + w + 1] << (64 - b);
+		}
+		r[i] = v;
+	}
+}
+
+/* a shift or rotate distance, or bit number.  anything that won't
+ * fit in 64 bits is simply "big".  */
+uint64_t
+limbs_distance(const uint64_t *x, int nlimbs)
+{
+	int i;
+
+	for (i = 1; i < nlimbs; i++) {
+		if (x[i])
+			return UINT64_MAX;
+	}
+	return x[0];
+}
+
+/* the limbs, modulo a small divisor, done 32 bits at a time so
+ * nothing overflows */
+uint64_t
+limbs_mod(const uint64_t *x, int nlimbs, uint64_t d)
+{
+	uint64_t rem = 0;
+	int i;
+
+	for (i = nlimbs - 1; i >= 0; i--) {
+		rem = ((rem << 32) | (x[i] >> 32)) % d;
+		rem = ((rem << 32) | (x[i] & 0xffffffff)) % d;
+	}
+	return rem;
+}
+
+void
+rshift_worker(uint64_t *r, const uint64_t *y, const uint64_t *x, int nlimbs)
+{
+	uint64_t i = limbs_distance(x, nlimbs);
 
+	if (i >= (uint64_t)bitwise_width()) {
+		memset(r, 0, (size_t)nlimbs * sizeof(*r));
+	} else {
 		if (i > (uint64_t)int_width)
 			i = (uint64_t)int_width;
-		while (i--) {
-			j = (j >> 1UL); // & ~(uint64_t)int_sign_bit;
-		}
-		*r = j;
+		limbs_shr(r, y, i, nlimbs);
 	}
 
 }
@@ -882,12 +1716,14 @@ rshift(void)
 }
 
 void
-lshift_worker(uint64_t *r, uint64_t y, uint64_t x)
+lshift_worker(uint64_t *r, const uint64_t *y, const uint64_t *x, int nlimbs)
 {
-	if (x >= (uint64_t)bitwise_width()) {
-		*r = 0;
+	uint64_t i = limbs_distance(x, nlimbs);
+
+	if (i >= (uint64_t)bitwise_width()) {
+		memset(r, 0, (size_t)nlimbs * sizeof(*r));
 	} else {
-		*r = y << x;
+		limbs_shl(r, y, i, nlimbs);
 	}
 }
 opreturn
@@ -896,18 +1732,31 @@ lshift(void)
 	return bitwise_2_op_shell("shift", lshift_worker, 1);
 }
 
+/* rotates happen within the current word width, no matter how
+ * many limbs are in use.  */
 void
-ror_worker(uint64_t *r, uint64_t y, uint64_t x)
+rotate_worker(uint64_t *r, const uint64_t *y, uint64_t i, int nlimbs)
 {
-	int64_t i = (int64_t)x;
-	int64_t j = (int64_t)y;
+	uint64_t hi[MAX_LIMBS];
+	int k;
+
+	i %= (uint64_t)int_width;
 
-	i %= bitwise_width();
-	while (i--) {
-		long long rbit = (j & 1);
-		j = (((j >> 1) & ~int_sign_bit) | (rbit << (int_width - 1)));
+	limbs_shr(r, y, i, nlimbs);
+	if (i) {
+		limbs_shl(hi, y, (uint64_t)int_width - i, nlimbs);
+		for (k = 0; k < nlimbs; k++)
+			r[k] |= hi[k];
 	}
-	*r = (uint64_t)j;
+	limbs_mask(r, nlimbs, int_width);
+}
+
+void
+ror_worker(uint64_t *r, const uint64_t *y, const uint64_t *x, int nlimbs)
+{
+	uint64_t i = limbs_mod(x, nlimbs, (uint64_t)bitwise_width());
+
+	rotate_worker(r, y, i, nlimbs);
 }
 
 opreturn
@@ -917,17 +1766,13 @@ rotateright(void)
 }
 
 void
-rol_worker(uint64_t *r, uint64_t y, uint64_t x)
+rol_worker(uint64_t *r, const uint64_t *y, const uint64_t *x, int nlimbs)
 {
-	int64_t i = (int64_t)x;
-	int64_t j = (int64_t)y;
+	uint64_t i = limbs_mod(x, nlimbs, (uint64_t)bitwise_width());
 
-	i %= bitwise_width();
-	while (i--) {
-		long long rbit = (j & int_sign_bit);
-		j = (((j << 1) & ~1) | (rbit != 0));
-	}
-	*r = (uint64_t)j;
+	/* rotating left by i is rotating right by the remainder */
+	i %= (uint64_t)int_width;
+	rotate_worker(r, y, (uint64_t)int_width - i, nlimbs);
 }
 
 opreturn
@@ -937,9 +1782,12 @@ rotateleft(void)
 }
 
 void
-bitwise_and_worker(uint64_t *r, uint64_t y, uint64_t x)
+bitwise_and_worker(uint64_t *r, const uint64_t *y, const uint64_t *x, int nlimbs)
 {
-	*r = x & y;
+	int i;
+
+	for (i = 0; i < nlimbs; i++)
+		r[i] = x[i] & y[i];
 }
 
 opreturn
@@ -949,9 +1797,12 @@ bitwise_and(void)
 }
 
 void
-bitwise_or_worker(uint64_t *r, uint64_t y, uint64_t x)
+bitwise_or_worker(uint64_t *r, const uint64_t *y, const uint64_t *x, int nlimbs)
 {
-	*r = x | y;
+	int i;
+
+	for (i = 0; i < nlimbs; i++)
+		r[i] = x[i] | y[i];
 }
 
 opreturn
@@ -961,9 +1812,12 @@ bitwise_or(void)
 }
 
 void
-bitwise_xor_worker(uint64_t *r, uint64_t y, uint64_t x)
+bitwise_xor_worker(uint64_t *r, const uint64_t *y, const uint64_t *x, int nlimbs)
 {
-	*r = x ^ y;
+	int i;
+
+	for (i = 0; i < nlimbs; i++)
+		r[i] = x[i] ^ y[i];
 }
 
 opreturn
@@ -973,14 +1827,13 @@ bitwise_xor(void)
 }
 
 void
-setbit_worker(uint64_t *r, uint64_t y, uint64_t x)
+setbit_worker(uint64_t *r, const uint64_t *y, const uint64_t *x, int nlimbs)
 {
-	uint64_t i = x, j = y;
+	uint64_t i = limbs_distance(x, nlimbs);
 
+	memcpy(r, y, (size_t)nlimbs * sizeof(*r));
 	if (i < (uint64_t)bitwise_width())
-		j |= (1LL << i);
-
-	*r = j;
+		r[i / 64] |= (1ULL << (i % 64));
 }
 
 opreturn
@@ -990,14 +1843,13 @@ setbit(void)
 }
 
 void
-clearbit_worker(uint64_t *r, uint64_t y, uint64_t x)
+clearbit_worker(uint64_t *r, const uint64_t *y, const uint64_t *x, int nlimbs)
 {
-	uint64_t i = x, j = y;
+	uint64_t i = limbs_distance(x, nlimbs);
 
+	memcpy(r, y, (size_t)nlimbs * sizeof(*r));
 	if (i < (uint64_t)bitwise_width())
-		j &= ~(1ULL << i);
-
-	*r = j;
+		r[i / 64] &= ~(1ULL << (i % 64));
 }
 
 opreturn
@@ -1012,7 +1864,8 @@ opreturn
 bitwise_1_op_shell(bitwise_1_op_func_t f)
 {
 	mpd_t *mx;
-	uint64_t x, r;
+	uint64_t x[MAX_LIMBS], r[MAX_LIMBS];
+	int nlimbs;
 
 	if (!mpop(&mx))
 		return BADOP;
@@ -1024,11 +1877,12 @@ bitwise_1_op_shell(bitwise_1_op_func_t f)
 
 	set_lastx(mx);
 
-	x = mpd_get_64_bits(0, 0, mx);
+	nlimbs = bitwise_limbs();
+	mpd_get_limbs(x, nlimbs, 0, 0, mx);
 
-	f(&r, x);
+	f(r, x, nlimbs);
 
-	mpd_set_u64(mx, r, ctx);
+	mpd_set_limbs(mx, r, nlimbs);
 
 	mpush(mx);
 
@@ -1036,11 +1890,12 @@ bitwise_1_op_shell(bitwise_1_op_func_t f)
 }
 
 void
-bitwise_not_worker(uint64_t *r, uint64_t x)
+bitwise_not_worker(uint64_t *r, const uint64_t *x, int nlimbs)
 {
-	uint64_t i = x;
+	int i;
 
-	*r = ~i;
+	for (i = 0; i < nlimbs; i++)
+		r[i] = ~x[i];
 }
 
 opreturn
@@ -1050,12 +1905,10 @@ bitwise_not(void)
 }
 
 void
-bitcount_worker(uint64_t *r, uint64_t x)
+bitcount_worker(uint64_t *r, const uint64_t *x, int nlimbs)
 {
-	uint64_t i = 0;
-
-	if (!floating_mode(mode))
-		x &= (uint64_t)int_mask;
+	uint64_t i = 0, u;
+	int k;
 
 	/*
 	 * I wasn't going to include a bitcount operator, until I came
@@ -1065,11 +1918,21 @@ bitcount_worker(uint64_t *r, uint64_t x)
 	 * by Peter Wegner, in CACM 3 (1960), 322.  It's not the fastest bit
 	 * counting technique, but very clever and very simple.
 	 */
-	while (x > 0) {
-		x &= x - 1;  // always clears the least significant 1
-		i++;
+	for (k = 0; k < nlimbs; k++) {
+		u = x[k];
+		if (!floating_mode(mode)) {
+			if (64 * k >= int_width)
+				break;
+			if (int_width - 64 * k < 64)
+				u &= (1ULL << (int_width - 64 * k)) - 1;
+		}
+		while (u > 0) {
+			u &= u - 1;  // always clears the least significant 1
+			i++;
+		}
 	}
-	*r = i;
+	memset(r, 0, (size_t)nlimbs * sizeof(*r));
+	r[0] = i;
 }
 
 opreturn
@@ -1095,13 +1958,13 @@ mpd_2_op_shell(mpd_2_op_func_t f)
 		return BADOP;
 	}
 
-	set_lastx(x);
 	set_lasty(y);
-	f(y, y, x, ctx);
+	if (mode != 'C' || !currency_op(f, y, y, x))
+		f(y, y, x, ctx);
 	if (!floating_mode(mode))
 		mpd_get_64_bits(0, y, y);
 
-	mpd_del(x);
+	mpd_del(move_lastx(x));
 	mpush(y);
 
 	return GOODOP;
@@ -1135,15 +1998,7 @@ divide(void)
 opreturn
 percent_worker(int which)
 {
-	static mpd_t *hundred;
-	if (!hundred) {
-		hundred = mpd_new(ctx);
-		mpd_set_string((mpd_t *)hundred, "100", ctx);
-	}
-
-	mpd_t *x, *y;
-
-	mpd_t *r = mpd_new(ctx);
+	mpd_t *x, *y, *r;
 
 	if (!mpop(&x))
 		return BADOP;
@@ -1153,10 +2008,14 @@ percent_worker(int which)
 		return BADOP;
 	}
 
-	set_lastx(x);
-	set_lasty(y);
+	/* x and y become lastx and lasty, and the old lastx holds
+	 * the result */
+	r = move_lastx(x);
+	mpd_del(move_lasty(y));
 
-	if (which == '?') {			// ((x - y) / y) * 100
+	if (mode == 'C' && currency_percent(which, r, y, x)) {
+		// done, natively
+	} else if (which == '?') {		// ((x - y) / y) * 100
 		mpd_sub(r, x, y, ctx);
 		mpd_div(r, r, y, ctx);
 		mpd_mul(r, r, hundred, ctx);
@@ -1173,8 +2032,6 @@ percent_worker(int which)
 	if (!floating_mode(mode))
 		mpd_get_64_bits(0, r, r);
 
-	mpd_del(x);
-	mpd_del(y);
 	mpush(r);
 
 	return GOODOP;
@@ -1232,21 +2089,169 @@ modulo(void)
 	return mpd_2_op_shell(mpd_mod);
 }
 
-opreturn
-y_to_the_x(void)
+/* r = y^n, for integer n, by squaring and multiplying, with a few
+ * guard digits so the result is only rounded once.  */
+void
+mpd_pow_int(mpd_t *r, const mpd_t *y, int64_t n, mpd_context_t *ctx)
 {
-	return mpd_2_op_shell(mpd_pow);
-}
+	mpd_context_t bctx = *ctx;
+	mpd_t *b, *acc;
+	uint64_t u = (n < 0) ? -(uint64_t)n : (uint64_t)n;
 
+	bctx.prec = ctx->prec + 22;  // 19 digits of n, and some
+	b = mpd_new(&bctx);
+	acc = mpd_new(&bctx);
+	mpd_copy(b, y, &bctx);
+	mpd_copy(acc, one, &bctx);
 
-// ------------------------  1 operand operators
-/* 1 operand functions */
+	while (u) {
+		if (u & 1)
+			mpd_mul(acc, acc, b, &bctx);
+		u >>= 1;
+		if (u)
+			mpd_mul(b, b, b, &bctx);
+	}
+	if (n < 0)
+		mpd_div(acc, one, acc, &bctx);
 
-opreturn
-mpd_1_op_shell(mpd_1_op_func_t f)
-{
-	mpd_t *x;
-	if (!mpop(&x))
+	mpd_plus(r, acc, ctx);
+	mpd_del(b);
+	mpd_del(acc);
+}
+
+/* r = cube root of y, for y > 0, by Newton's method:
+ *	r' = (2r + y/r^2) / 3
+ * starting from a low precision guess.  */
+void
+mpd_cbrt(mpd_t *r, const mpd_t *y, mpd_context_t *ctx)
+{
+	mpd_context_t bctx = *ctx, gctx = *ctx;
+	mpd_t *g, *t, *third;
+	int i;
+
+	bctx.prec = ctx->prec + 5;
+	gctx.prec = 16;
+	g = mpd_new(&bctx);
+	t = mpd_new(&bctx);
+	third = mpd_new(&gctx);
+
+	mpd_div_i64(third, one, 3, &gctx);
+	mpd_pow(g, y, third, &gctx);
+
+	for (i = 0; i < 50; i++) {
+		mpd_mul(t, g, g, &bctx);
+		mpd_div(t, y, t, &bctx);
+		mpd_fma(t, g, two, t, &bctx);	// 2g + y/g^2
+		mpd_div_i64(t, t, 3, &bctx);
+		mpd_sub(g, t, g, &bctx);
+		if (mpd_iszero(g) ||
+			    mpd_adjexp(g) < mpd_adjexp(t) - bctx.prec + 1) {
+			mpd_copy(g, t, &bctx);
+			break;
+		}
+		mpd_copy(g, t, &bctx);
+	}
+
+	/* perfect cubes come out exact */
+	mpd_round_to_int(t, g, &bctx);
+	mpd_mul(third, t, t, &bctx);
+	mpd_mul(third, third, t, &bctx);
+	if (mpd_cmp(third, y, &bctx) == 0)
+		mpd_copy(g, t, &bctx);
+
+	mpd_plus(r, g, ctx);
+	mpd_del(g);
+	mpd_del(t);
+	mpd_del(third);
+}
+
+/* y^x.  mpd_pow() handles everything, but the common cases are
+ * done more directly:  integer powers by squaring and multiplying
+ * (natively, modulo the word size, in integer modes), and powers of
+ * 1/2 and 1/3 with square and cube roots.  0^0 is left to mpd_pow().
+ * r may be the same as y.  */
+void
+mpd_power(mpd_t *r, const mpd_t *y, const mpd_t *x, mpd_context_t *ctx)
+{
+	static mpd_t *half, *third;
+	static mpd_ssize_t third_prec;
+	uint32_t status = 0;
+	int64_t n;
+
+	if (!half) {
+		half = mpd_new(ctx);
+		third = mpd_new(ctx);
+		mpd_set_string(half, "0.5", ctx);
+	}
+
+	if (mpd_isspecial(y) || mpd_isspecial(x) ||
+			(mpd_iszero(y) && mpd_iszero(x))) {
+		mpd_pow(r, y, x, ctx);
+		return;
+	}
+
+	if (!floating_mode(mode) && mpd_isinteger(x) && !mpd_isnegative(x)) {
+		uint64_t e = mpd_qget_u64(x, &status);
+
+		if (int_width <= (int)LONGLONG_BITS && !status) {
+			uint64_t b = mpd_get_64_bits(0, 0, (mpd_t *)y);
+			uint64_t acc = 1;
+
+			/* unsigned arithmetic wraps modulo 2^64, which
+			 * is right for any smaller width, too */
+			while (e) {
+				if (e & 1)
+					acc *= b;
+				e >>= 1;
+				b *= b;
+			}
+			mpd_set_u64(r, acc & (uint64_t)int_mask, ctx);
+		} else {
+			mpd_powmod(r, y, x, int_modulo, ctx);
+		}
+		return;
+	}
+
+	if (mpd_isinteger(x)) {
+		n = mpd_qget_i64(x, &status);
+		if (!status && n > -(1LL << 31) && n < (1LL << 31)) {
+			mpd_pow_int(r, y, n, ctx);
+			return;
+		}
+	}
+
+	if (mpd_cmp(x, half, ctx) == 0) {
+		mpd_sqrt(r, y, ctx);
+		return;
+	}
+
+	if (third_prec != ctx->prec) {
+		mpd_div_i64(third, one, 3, ctx);
+		third_prec = ctx->prec;
+	}
+	if (mpd_cmp(x, third, ctx) == 0 && mpd_ispositive(y)) {
+		mpd_cbrt(r, y, ctx);
+		return;
+	}
+
+	mpd_pow(r, y, x, ctx);
+}
+
+opreturn
+y_to_the_x(void)
+{
+	return mpd_2_op_shell(mpd_power);
+}
+
+
+// ------------------------  1 operand operators
+/* 1 operand functions */
+
+opreturn
+mpd_1_op_shell(mpd_1_op_func_t f)
+{
+	mpd_t *x;
+	if (!mpop(&x))
 		return BADOP;
 
 	set_lastx(x);
@@ -1259,6 +2264,179 @@ mpd_1_op_shell(mpd_1_op_func_t f)
 	return GOODOP;
 }
 
+/* The transcendental functions are slow, and the same few arguments
+ * ("30 sin", "2 ln") tend to come up again and again.  Their results
+ * are remembered in a small LRU cache, keyed on the function, the
+ * exact operand, the working precision, and degrees vs. radians.  */
+
+#define MEMO_SIZE 128	/* entries */
+#define MEMO_HASH 256	/* hash buckets, a power of 2 */
+
+struct memo {
+	mpd_1_op_func_t f;
+	mpd_t *arg;
+	mpd_t *result;
+	mpd_ssize_t prec;
+	int degrees;
+	uint32_t hash;
+	int hnext;		/* next in hash chain */
+	int newer, older;	/* lru list */
+};
+
+/* links are entry index + 1, so 0 means none */
+struct memo memo[MEMO_SIZE];
+int memo_bucket[MEMO_HASH];
+int memo_newest, memo_oldest, memo_used;
+long memo_hits, memo_misses;
+
+#define MEMO(i) (&memo[(i) - 1])
+
+uint32_t
+memo_hash(mpd_1_op_func_t f, const mpd_t *x)
+{
+	uint64_t h = (uint64_t)(uintptr_t)f;
+	mpd_ssize_t i;
+
+	h = h * 31 + x->flags;
+	h = h * 31 + (uint64_t)x->exp;
+	h = h * 31 + (uint64_t)ctx->prec;
+	h = h * 31 + (uint64_t)trig_degrees;
+	for (i = 0; i < x->len; i++)
+		h = h * 0x100000001b3ULL + x->data[i];
+
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+void
+memo_unlink_lru(int i)
+{
+	struct memo *m = MEMO(i);
+
+	if (m->newer) MEMO(m->newer)->older = m->older;
+	else memo_newest = m->older;
+	if (m->older) MEMO(m->older)->newer = m->newer;
+	else memo_oldest = m->newer;
+}
+
+void
+memo_make_newest(int i)
+{
+	struct memo *m = MEMO(i);
+
+	m->newer = 0;
+	m->older = memo_newest;
+	if (memo_newest)
+		MEMO(memo_newest)->newer = i;
+	memo_newest = i;
+	if (!memo_oldest)
+		memo_oldest = i;
+}
+
+/* compute f(x) into r, from the cache if possible */
+void
+memo_1_op(mpd_1_op_func_t f, mpd_t *r, const mpd_t *x)
+{
+	static mpd_t *memo_arg;
+	uint32_t h = memo_hash(f, x);
+	int *bp = &memo_bucket[h & (MEMO_HASH - 1)];
+	struct memo *m;
+	long errors;
+	int i;
+
+	for (i = *bp; i; i = m->hnext) {
+		m = MEMO(i);
+		if (m->hash == h && m->f == f && m->prec == ctx->prec &&
+				m->degrees == trig_degrees &&
+				mpd_cmp_total(m->arg, x) == 0) {
+			memo_hits++;
+			memo_unlink_lru(i);
+			memo_make_newest(i);
+			mpd_copy(r, m->result, ctx);
+			return;
+		}
+	}
+	memo_misses++;
+
+	/* x and r may be the same, so save the argument first.  a
+	 * result that came with an error or a warning isn't kept, so
+	 * the message is repeated along with the calculation.  */
+	if (!memo_arg)
+		memo_arg = mpd_new(ctx);
+	mpd_copy(memo_arg, x, ctx);
+	errors = error_count;
+	f(r, x, ctx);
+	if (error_count != errors || !mpd_isfinite(r))
+		return;
+
+	/* use a free entry, or evict the least recently used */
+	if (memo_used < MEMO_SIZE) {
+		i = ++memo_used;
+		m = MEMO(i);
+		m->arg = mpd_new(ctx);
+		m->result = mpd_new(ctx);
+	} else {
+		int *lp;
+
+		i = memo_oldest;
+		m = MEMO(i);
+		memo_unlink_lru(i);
+		lp = &memo_bucket[m->hash & (MEMO_HASH - 1)];
+		while (*lp != i)
+			lp = &MEMO(*lp)->hnext;
+		*lp = m->hnext;
+	}
+
+	mpd_copy(m->arg, memo_arg, ctx);
+	mpd_copy(m->result, r, ctx);
+
+	m->f = f;
+	m->prec = ctx->prec;
+	m->degrees = trig_degrees;
+	m->hash = h;
+	m->hnext = *bp;
+	*bp = i;
+	memo_make_newest(i);
+}
+
+opreturn
+memo_1_op_shell(mpd_1_op_func_t f)
+{
+	mpd_t *x;
+	if (!mpop(&x))
+		return BADOP;
+
+	set_lastx(x);
+	memo_1_op(f, x, x);
+	if (!floating_mode(mode))
+		mpd_get_64_bits(0, x, x);
+
+	mpush(x);
+
+	return GOODOP;
+}
+
+opreturn
+cachestats(void)
+{
+	p_printf(" transcendental cache: %ld hits, %ld misses,"
+		" %d of %d entries in use\n",
+		memo_hits, memo_misses, memo_used, MEMO_SIZE);
+	return GOODOP;
+}
+
+opreturn
+allocstats(void)
+{
+	p_printf(" number pool: %ld mallocs, %ld reused, %ld frees,"
+		" %ld reallocs\n", pool_stats.mallocs, pool_stats.reuses,
+		pool_stats.frees, pool_stats.reallocs);
+	p_printf("   %ld bytes in use, %ld at most\n",
+		pool_stats.inuse, pool_stats.hiwater);
+	p_printf(" line scratch: %ld allocations, %ld bytes at most\n",
+		scratch_allocs, scratch_hiwater);
+	return GOODOP;
+}
+
 opreturn
 nop(void)
 {
@@ -1300,13 +2478,12 @@ squarert(void)
 opreturn
 e_to_the_x(void)
 {
-	return mpd_1_op_shell(mpd_exp);
+	return memo_1_op_shell(mpd_exp);
 }
 
-opreturn
-log_base2(void)
+void
+mpd_log2(mpd_t *r, const mpd_t *x, mpd_context_t *ctx)
 {
-	mpd_t *x;
 	static mpd_t *ln2;
 
 	if (!ln2) { // initialization
@@ -1315,27 +2492,26 @@ log_base2(void)
 		mpd_ln(ln2, ln2, ctx);
 	}
 
-	if (!mpop(&x))
-		return BADOP;
-
-	set_lastx(x);
-	mpd_ln(x, x, ctx);
-	mpd_div(x, x, ln2, ctx);
-	mpush(x);
+	mpd_ln(r, x, ctx);
+	mpd_div(r, r, ln2, ctx);
+}
 
-	return GOODOP;
+opreturn
+log_base2(void)
+{
+	return memo_1_op_shell(mpd_log2);
 }
 
 opreturn
 log_natural(void)
 {
-	return mpd_1_op_shell(mpd_ln);
+	return memo_1_op_shell(mpd_ln);
 }
 
 opreturn
 log_base10(void)
 {
-	return mpd_1_op_shell(mpd_log10);
+	return memo_1_op_shell(mpd_log10);
 }
 
 opreturn
@@ -1398,6 +2574,135 @@ mpd_user_angle_to_radians(mpd_t *rads, const mpd_t *user, mpd_context_t *ctx)
 		mpd_copy(rads, user, ctx);
 }
 
+/* Reducing a big angle modulo 2pi needs 2pi to (at least) as many
+ * digits as the angle has before its decimal point, plus our working
+ * precision.  This copy of 2pi is calculated as needed, and only
+ * grows.  (Machin's formula:  pi = 16 * atan(1/5) - 4 * atan(1/239).) */
+
+/* beyond this many integer digits, an angle in radians is refused */
+#define TRIG_MAX_REDUCTION 10000
+
+void
+mpd_atan_inverse(mpd_t *r, int k, mpd_context_t *bctx)
+{
+	mpd_t *term = mpd_new(bctx), *t = mpd_new(bctx), *kk = mpd_new(bctx);
+	int64_t n;
+
+	mpd_set_i64(kk, (int64_t)k * k, bctx);
+	mpd_set_i64(term, k, bctx);
+	mpd_div(term, one, term, bctx);		// 1/k
+	mpd_copy(r, term, bctx);
+
+	for (n = 3; ; n += 2) {
+		mpd_div(term, term, kk, bctx);	// 1/k^n
+		mpd_set_i64(t, n, bctx);
+		mpd_div(t, term, t, bctx);
+		if (mpd_iszero(t) ||
+		    mpd_adjexp(t) < mpd_adjexp(r) - bctx->prec - 2)
+			break;
+		if ((n / 2) & 1)
+			mpd_sub(r, r, t, bctx);
+		else
+			mpd_add(r, r, t, bctx);
+	}
+
+	mpd_del(term);
+	mpd_del(t);
+	mpd_del(kk);
+}
+
+const mpd_t *
+two_pi_to(mpd_ssize_t prec)
+{
+	static mpd_t *big_two_pi;
+	static mpd_ssize_t big_prec;
+	mpd_context_t bctx;
+	mpd_t *t;
+
+	if (prec <= big_prec)
+		return big_two_pi;
+
+	if (prec < 2 * big_prec)
+		prec = 2 * big_prec;
+
+	bctx = *ctx;
+	bctx.prec = prec + 5;
+	if (!big_two_pi)
+		big_two_pi = mpd_new(&bctx);
+	t = mpd_new(&bctx);
+
+	mpd_atan_inverse(big_two_pi, 5, &bctx);
+	mpd_mul_i64(big_two_pi, big_two_pi, 32, &bctx);
+	mpd_atan_inverse(t, 239, &bctx);
+	mpd_mul_i64(t, t, 8, &bctx);
+	mpd_sub(big_two_pi, big_two_pi, t, &bctx);
+	mpd_del(t);
+
+	big_prec = prec;
+	trace(EXEC, "2pi extended to %ld digits\n", (long)prec);
+	return big_two_pi;
+}
+
+/* r = x mod 2pi, in [0, 2pi), for x in radians.  small angles only
+ * need our regular 2pi.  */
+void
+mpd_reduce_radians(mpd_t *r, const mpd_t *x, mpd_context_t *ctx)
+{
+	mpd_ssize_t adj = mpd_adjexp(x);
+	mpd_context_t bctx;
+
+	if (adj < 3) {
+		mpd_rem(r, x, two_pi, ctx);
+	} else if (adj > TRIG_MAX_REDUCTION) {
+		error(" error: angle too large for trig functions\n");
+		mpd_setspecial(r, MPD_NEG, MPD_NAN);
+		return;
+	} else {
+		bctx = *ctx;
+		bctx.prec = ctx->prec + adj + 10;
+		mpd_rem(r, x, two_pi_to(bctx.prec), &bctx);
+		mpd_plus(r, r, ctx);	// back to working precision
+	}
+
+	if (mpd_isnegative(r))
+		mpd_add(r, r, two_pi, ctx);
+}
+
+/* r = x mod 360, exactly, for x in degrees.  an integer with a large
+ * exponent, c * 10^e, is reduced as (c mod 360) * (10^e mod 360).  */
+void
+mpd_reduce_degrees(mpd_t *r, const mpd_t *x, mpd_context_t *ctx)
+{
+	static mpd_t *c, *t, *ten, *three_sixty;
+	mpd_context_t bctx;
+
+	if (!c) {
+		c = mpd_new(ctx);
+		t = mpd_new(ctx);
+		ten = mpd_new(ctx);
+		three_sixty = mpd_new(ctx);
+		mpd_set_i64(ten, 10, ctx);
+		mpd_set_i64(three_sixty, 360, ctx);
+	}
+
+	if (x->exp > 0) {
+		mpd_copy(c, x, ctx);
+		c->exp = 0;
+		mpd_rem(c, c, three_sixty, ctx);
+		mpd_set_i64(t, x->exp, ctx);
+		mpd_powmod(t, ten, t, three_sixty, ctx);
+		mpd_mul(c, c, t, ctx);
+		mpd_rem(r, c, three_sixty, ctx);
+		return;
+	}
+
+	/* otherwise the quotient has no more digits than x does */
+	bctx = *ctx;
+	if (bctx.prec < x->digits + 5)
+		bctx.prec = x->digits + 5;
+	mpd_rem(r, x, three_sixty, &bctx);
+}
+
 void
 mpd_cos(mpd_t *m, const mpd_t *ix, mpd_context_t *ctx)
 {
@@ -1421,13 +2726,21 @@ mpd_cos(mpd_t *m, const mpd_t *ix, mpd_context_t *ctx)
 		n = mpd_new(ctx);
 	}
 
-	if (mpd_mag_lessthan(ix, -TRIG_CALC_DIGITS))
+	if (mpd_mag_lessthan(ix, -TRIG_CALC_DIGITS)) {
 		mpd_copy(x, zero, ctx);
-	else
-		mpd_user_angle_to_radians(x, ix, ctx);
+	} else if (trig_degrees) {
+		mpd_reduce_degrees(x, ix, ctx);
+		mpd_degrees_to_radians(x, x, ctx);
+	} else {
+		mpd_copy(x, ix, ctx);
+	}
 
 	// x = mod(x, 2 * pi);
-	mpd_divmod(t, x, x, two_pi, ctx);
+	mpd_reduce_radians(x, x, ctx);
+	if (mpd_isnan(x)) {
+		mpd_copy(m, x, ctx);
+		return;
+	}
 
 	trace_mpd(EXEC, "x after mod", x);
 	negate = 0;
@@ -1513,10 +2826,14 @@ mpd_sin(mpd_t *m, const mpd_t *x, mpd_context_t *ctx)
 	static mpd_t *t;
 	if (!t) t = mpd_new(ctx);
 
-	if (trig_degrees)
-		mpd_sub(t, ninety, x, ctx);
-	else
-		mpd_sub(t, pi_over_2, x, ctx);
+	/* reduce first, or a big x would swamp the 90 or pi/2 */
+	if (trig_degrees) {
+		mpd_reduce_degrees(t, x, ctx);
+		mpd_sub(t, ninety, t, ctx);
+	} else {
+		mpd_reduce_radians(t, x, ctx);
+		mpd_sub(t, pi_over_2, t, ctx);
+	}
 	mpd_cos(m, t, ctx);
 }
 
@@ -1794,7 +3111,7 @@ sine(void)
 	if (!floating_mode(mode))
 		return trig_no_sense();
 
-	return mpd_1_op_shell(mpd_sin);
+	return memo_1_op_shell(mpd_sin);
 }
 
 opreturn
@@ -1803,7 +3120,7 @@ cosine(void)
 	if (!floating_mode(mode))
 		return trig_no_sense();
 
-	return mpd_1_op_shell(mpd_cos);
+	return memo_1_op_shell(mpd_cos);
 }
 
 opreturn
@@ -1812,7 +3129,7 @@ tangent(void)
 	if (!floating_mode(mode))
 		return trig_no_sense();
 
-	return mpd_1_op_shell(mpd_tan);
+	return memo_1_op_shell(mpd_tan);
 }
 
 opreturn
@@ -1821,7 +3138,7 @@ asine(void)
 	if (!floating_mode(mode))
 		return trig_no_sense();
 
-	return mpd_1_op_shell(mpd_asin);
+	return memo_1_op_shell(mpd_asin);
 }
 
 opreturn
@@ -1830,7 +3147,7 @@ acosine(void)
 	if (!floating_mode(mode))
 		return trig_no_sense();
 
-	return mpd_1_op_shell(mpd_acos);
+	return memo_1_op_shell(mpd_acos);
 }
 
 opreturn
@@ -1839,7 +3156,7 @@ atangent(void)
 	if (!floating_mode(mode))
 		return trig_no_sense();
 
-	return mpd_1_op_shell(mpd_atan);
+	return memo_1_op_shell(mpd_atan);
 }
 
 opreturn
@@ -1867,14 +3184,11 @@ logical_compare_worker(int *xz, int *yz)
 		return BADOP;
 	}
 
-	set_lastx(x);
-	set_lasty(y);
-
 	*xz = mpd_iszero(x);
 	*yz = mpd_iszero(y);
 
-	mpd_del(x);
-	mpd_del(y);
+	mpd_del(move_lastx(x));
+	mpd_del(move_lasty(y));
 
 	return GOODOP;
 }
@@ -1913,11 +3227,9 @@ logical_not(void)
 	if (!mpop(&x))
 		return BADOP;
 
-	set_lastx(x);
-
-	mpush_copy( mpd_iszero(x) ? one : zero);
-
-	mpd_del(x);
+	x = move_lastx(x);
+	mpd_copy(x, mpd_iszero(lastx) ? one : zero, ctx);
+	mpush(x);
 
 	return GOODOP;
 }
@@ -1931,10 +3243,76 @@ logical_not(void)
 #define GT  5
 #define GE  6
 
+/* does a value round to zero at the comparison precision?  1 if
+ * it does, 0 if it doesn't, and -1 if it's too close to tell.  */
+int
+visibly_zero(const mpd_t *v)
+{
+	mpd_ssize_t a;
+
+	if (mpd_iszero(v))
+		return 1;
+	a = mpd_adjexp(v);
+	if (a >= -COMPARISON_DIGITS)
+		return 0;
+	if (a < -COMPARISON_DIGITS - 1)
+		return 1;
+	return -1;
+}
+
+/* compare y to x as if both had first been rounded to COMPARISON_DIGITS
+ * places, i.e., equal if they match at the visible precision.  most
+ * pairs need no rounding, or are decided by their signs and adjusted
+ * exponents alone.  the rest are rounded into scratch values, which
+ * keep their storage from call to call.  */
+int
+visible_compare(const mpd_t *y, const mpd_t *x)
+{
+	static mpd_t *ys, *xs;
+	mpd_context_t cctx;
+	mpd_ssize_t ya, xa;
+	int yz, xz, ysign, xsign;
+
+	if (mpd_isspecial(y) || mpd_isspecial(x) ||
+			(y->exp >= -COMPARISON_DIGITS &&
+			 x->exp >= -COMPARISON_DIGITS))
+		return mpd_cmp(y, x, ctx);	// nothing to round
+
+	yz = visibly_zero(y);
+	xz = visibly_zero(x);
+	if (yz >= 0 && xz >= 0) {
+		ysign = yz ? 0 : (mpd_isnegative(y) ? -1 : 1);
+		xsign = xz ? 0 : (mpd_isnegative(x) ? -1 : 1);
+		if (ysign != xsign)
+			return ysign - xsign;
+		if (ysign == 0)
+			return 0;
+		/* rounding moves a value less than one unit in its
+		 * adjusted exponent, so two or more apart is decisive */
+		ya = mpd_adjexp(y);
+		xa = mpd_adjexp(x);
+		if (ya > xa + 1)
+			return ysign;
+		if (xa > ya + 1)
+			return -ysign;
+	}
+
+	if (!ys) {
+		ys = mpd_new(ctx);
+		xs = mpd_new(ctx);
+	}
+	cctx = *ctx;
+	cctx.prec = ctx->prec + COMPARISON_DIGITS + 2;
+	mpd_rescale(ys, y, -COMPARISON_DIGITS, &cctx);
+	mpd_rescale(xs, x, -COMPARISON_DIGITS, &cctx);
+	return mpd_cmp(ys, xs, &cctx);
+}
+
 opreturn
 numeric_compare_worker(int c)
 {
-	mpd_t *x, *y;
+	mpd_t *x, *y, *res;
+	int r, t = 0;
 
 	if (!mpop(&x)) {
 		return BADOP;
@@ -1944,31 +3322,24 @@ numeric_compare_worker(int c)
 		return BADOP;
 	}
 
-	set_lastx(x);
-	set_lasty(y);
-
-	if (mpd_isnan(x) || mpd_isnan(y)) {
-		mpd_del(x);
-		mpd_del(y);
-		mpush_copy(zero);
-		return GOODOP;
-	}
-
-	mpd_rescale(x, x, -COMPARISON_DIGITS, ctx);
-	mpd_rescale(y, y, -COMPARISON_DIGITS, ctx);
-
-	int r = mpd_cmp(y, x, ctx);
-	switch(c) {
-	case EQ:  mpush_copy((r == 0) ? one : zero); break;
-	case NEQ: mpush_copy((r != 0) ? one : zero); break;
-	case LT:  mpush_copy((r < 0) ? one : zero); break;
-	case LE:  mpush_copy((r <= 0) ? one : zero); break;
-	case GT:  mpush_copy((r > 0) ? one : zero); break;
-	case GE:  mpush_copy((r >= 0) ? one : zero); break;
+	if (!mpd_isnan(x) && !mpd_isnan(y)) {
+		r = visible_compare(y, x);
+		switch(c) {
+		case EQ:  t = (r == 0); break;
+		case NEQ: t = (r != 0); break;
+		case LT:  t = (r < 0); break;
+		case LE:  t = (r <= 0); break;
+		case GT:  t = (r > 0); break;
+		case GE:  t = (r >= 0); break;
+		}
 	}
 
-	mpd_del(x);
-	mpd_del(y);
+	/* the operands become lastx and lasty, and the old lastx
+	 * holds the result, so only the old lasty is freed */
+	res = move_lastx(x);
+	mpd_del(move_lasty(y));
+	mpd_copy(res, t ? one : zero, ctx);
+	mpush(res);
 
 	return GOODOP;
 }
@@ -2023,10 +3394,10 @@ clear(void)
 	if (mpeek2(&x))
 		set_lasty(x);
 
-	while(stack) {
-		mpop(&x);
-		mpd_del(x);
-	}
+	num_release(stack);
+	stack = NULL;
+	stack_count = 0;
+	stack_mark = 0;
 
 	return GOODOP;
 }
@@ -2116,24 +3487,58 @@ pending_allow(void)
 	pending_enabled = 1;
 }
 
+boolean pending_empty = TRUE;
+
+/* set by "P":  the stack is shown after the rest of the pending
+ * output, directly, rather than being accumulated in memory */
+boolean pending_stack = FALSE;
+boolean pending_direct = FALSE;
+
 void
 pending_clear(void)
 {
-	if (pp.fp) {
+	pending_stack = FALSE;
+	if (pp.fp && !pending_empty) {
 		rewind(pp.fp);
 		fputc('\0', pp.fp);
 		fseek(pp.fp, -1, SEEK_CUR);
+		pending_empty = TRUE;
 	}
 }
 
 void
 pending_show(void)
 {
-	if (pp.fp && pending_enabled) {
+	void printstack(boolean conv, struct num *s);
+	void put_list(int count);
+
+	if (!pending_enabled)
+		return;
+
+	if (proto_mode) {  // only responses go to stdout
+		pending_clear();
+		return;
+	}
+
+	if (json_output || csv_output) {  // only data goes to stdout
+		if (pending_stack) {
+			put_list(stack_count);
+			putchar('\n');
+		}
+		pending_clear();
+		return;
+	}
+
+	if (pp.fp) {
 		fflush(pp.fp);
 		printf("%s", pp.bufp);
-		pending_clear();
 	}
+	if (pending_stack) {
+		pending_direct = TRUE;
+		printstack(0, stack);
+		pending_direct = FALSE;
+	}
+	pending_clear();
 }
 
 /* used for any informative feedback, which is only printed if the
@@ -2143,6 +3548,13 @@ p_printf(const char *fmt, ...)  // short for pending_printf()
 {
 	va_list ap;
 
+	if (pending_direct) {
+		va_start(ap, fmt);
+		vprintf(fmt, ap);
+		va_end(ap);
+		return;
+	}
+
 	if (!pp.fp)
 		memfile_open(&pp);
 
@@ -2152,6 +3564,7 @@ p_printf(const char *fmt, ...)  // short for pending_printf()
 	// ensure it's always null-terminated
 	fputc('\0', pp.fp);
 	fseek(pp.fp, -1, SEEK_CUR);
+	pending_empty = FALSE;
 }
 
 struct memfile mp;
@@ -2331,19 +3744,60 @@ putsigned(long long ln)
 	return mp.bufp;
 }
 
+/* nbits (no more than 8) of an integer's limbs, starting at bit pos */
+unsigned int
+limbs_field(const uint64_t *u, int pos, int nbits)
+{
+	int k = pos / 64, b = pos % 64;
+	uint64_t v = u[k] >> b;
+
+	if (b + nbits > 64 && k + 1 < int_limbs)
+		v |= u[k + 1] << (64 - b);
+
+	return (unsigned int)(v & ((1U << nbits) - 1));
+}
+
+/* decimal display of integers wider than 64 bits */
 char *
-putbinary(unsigned long long u)
+putwide(const uint64_t *u, boolean is_signed)
 {
-	int i;
-	int zf = zerofill; // leading_zeros;
+	static char *tbuf;
+	static mpd_t *v;
+	char *s;
 
-	u &= (ull_t)int_mask;
+	if (!tbuf) {
+		tbuf = safe_calloc(TEMP_BUFSIZE);
+		v = mpd_new(ctx);
+	}
 
 	m_file_start();
 
-	fprintf(mp.fp, " 0b");
+	mpd_set_limbs(v, u, int_limbs);
+	if (is_signed && limbs_field(u, int_width - 1, 1))
+		mpd_sub(v, v, int_modulo, ctx);
+
+	s = mpd_to_sci(v, 0);
+	safe_snprintf(tbuf, TEMP_BUFSIZE, "putwide", " %s", s);
+	mpd_free(s);
+	add_digit_grouping(tbuf);
+	fputs(tbuf, mp.fp);
+
+	m_file_finish();
+
+	return mp.bufp;
+}
+
+char *
+putbinary(const uint64_t *u)
+{
+	int i;
+	int zf = zerofill; // leading_zeros;
+
+	m_file_start();
+
+	fprintf(mp.fp, " 0b");
 	for (i = int_width-1; i >= 0; i--) {
-		if (u & (1L << i)) {
+		if (limbs_field(u, i, 1)) {
 			fputc('1', mp.fp);
 			zf = 1;
 		} else if (zf || i == 0) {
@@ -2361,19 +3815,17 @@ putbinary(unsigned long long u)
 }
 
 char *
-puthex(unsigned long long u)
+puthex(const uint64_t *u)
 {
 	int i;
 	int nibbles = ((int_width + 3) / 4);
 	int zf = zerofill; // leading_zeros;
 
-	u &= (ull_t)int_mask;
-
 	m_file_start();
 
 	fprintf(mp.fp," 0x");
 	for (i = nibbles-1; i >= 0; i--) {
-		int nibble = (u >> (4 * i)) & 0xf;
+		unsigned int nibble = limbs_field(u, 4 * i, 4);
 		if (nibble || zf || i == 0) {
 		    fputc("0123456789abcdef"[nibble], mp.fp);
 		    zf = 1;
@@ -2390,19 +3842,17 @@ puthex(unsigned long long u)
 }
 
 char *
-putoct(unsigned long long u)
+putoct(const uint64_t *u)
 {
 	int i;
 	int triplets = ((int_width + 2) / 3);
 	int zf = zerofill; // leading_zeros;
 
-	u &= (ull_t)int_mask;
-
 	m_file_start();
 
 	fprintf(mp.fp," 0o");
 	for (i = triplets-1; i >= 0; i--) {
-		int triplet = (u >> (3 * i)) & 7;
+		unsigned int triplet = limbs_field(u, 3 * i, 3);
 		if (triplet || zf || i == 0) {
 		    fputc("01234567"[triplet], mp.fp);
 		    zf = 1;
@@ -2422,6 +3872,9 @@ putoct(unsigned long long u)
 void
 show_int_truncation(boolean changed, mpd_t *old, char *mark)
 {
+	if (proto_mode)  // nothing's displayed
+		return;
+
 	if (!changed) {
 		p_printf("%s\n", mark);
 		return;
@@ -2643,7 +4096,7 @@ print_floating(mpd_t *m, int printmode)
 
 		char *s = mpd_format(m, fmt, ctx);
 		safe_snprintf(tbuf, TEMP_BUFSIZE, "'auto' format", "%s", s);
-		free(s);
+		mpd_free(s);
 
 		if (printmode != 'M')
 			trim_g_trailing_zeros(tbuf);
@@ -2689,7 +4142,7 @@ print_floating(mpd_t *m, int printmode)
 		// use it to get fixed notation
 		char *s = mpd_format(m, fmt, ctx);
 		safe_snprintf(tbuf, TEMP_BUFSIZE, "'fixed' format", "%s", s);
-		free(s);
+		mpd_free(s);
 
 		add_digit_grouping(tbuf);
 		fputs(tbuf, mp.fp);
@@ -2703,7 +4156,7 @@ print_floating(mpd_t *m, int printmode)
 		// use it to get scientific notation
 		char *s = mpd_format(m, fmt, ctx);
 		safe_snprintf(tbuf, TEMP_BUFSIZE, "'eng' format", "%s", s);
-		free(s);
+		mpd_free(s);
 
 		// convert it to engineering format
 		if (!convert_eng_format(tbuf)) {
@@ -2754,19 +4207,118 @@ floating_alignment(char *s)
 	return align;
 }
 
-void
-print_n(mpd_t *m, int printmode, boolean conv, char *mark)
+/* format the (already masked) integer in u for display in printmode.
+ * returns 0 for a mode that isn't an integer mode.  */
+char *
+int_string(uint64_t *u, int printmode)
 {
 	int64_t ln;
-	uint64_t u;
+
+	switch (printmode) {
+	case 'H':
+		return puthex(u);
+	case 'O':
+		return putoct(u);
+	case 'B':
+		return putbinary(u);
+	case 'U':
+		if (int_width > (int)LONGLONG_BITS)
+			return putwide(u, 0);
+		return putunsigned(u[0]);
+	case 'D':
+		if (int_width > (int)LONGLONG_BITS)
+			return putwide(u, 1);
+		/* shenanigans to make pos/neg numbers appear
+		 * properly.  our masked/shortened numbers
+		 * don't appear as negative to printf, so we
+		 * find the reduced-width sign bit, and fake
+		 * it.
+		 */
+
+		// long long mask;
+		ln = (ll_t)u[0];
+		// mask gives us everything but the sign bit
+		// mask = (long long)int_mask & ~int_sign_bit;
+		if (ln & int_sign_bit) {	// it's negative
+			ln |= ~int_mask;
+		} else {
+			ln &= int_mask;
+		}
+		return putsigned(ln);
+	}
+	return 0;
+}
+
+/* stack entries are usually displayed many times (by autoprint, or
+ * "P") without changing, so each keeps the string it was last shown
+ * as.  it's good until the value changes, or until display_gen does,
+ * which happens when any setting that affects formatting changes.  */
+long display_gen;
+
+void
+display_check(void)
+{
+	static int digits, width, zf, seps, ra = -1, frac;
+	static char *spec;
+
+	if (digits != float_digits || spec != float_specifier ||
+			width != int_width || zf != zerofill ||
+			seps != digitseparators || ra != rightalignment ||
+			frac != frac_digits) {
+		digits = float_digits;
+		spec = float_specifier;
+		width = int_width;
+		zf = zerofill;
+		seps = digitseparators;
+		ra = rightalignment;
+		frac = frac_digits;
+		display_gen++;
+	}
+}
+
+void
+num_remember(struct num *s, char *pf, int printmode)
+{
+	size_t len = strlen(pf) + 1;
+
+	struct val *v = s->val;
+
+	num_forget(s);
+	if (!(v->shown = (char *)mpd_mallocfunc(len)))
+		return;
+	memcpy(v->shown, pf, len);
+	v->shown_mode = printmode;
+	v->shown_gen = display_gen;
+}
+
+/* print m in printmode.  if m belongs to a stack entry, s is the
+ * entry, and its saved string is used, or saved, if possible.  */
+void
+print_num(mpd_t *m, struct num *s, int printmode, boolean conv, char *mark)
+{
+	uint64_t u[MAX_LIMBS];
+	char *pf;
 	int align;
 	int changed = 0;
 
 	if (!mark) mark = "";
 
+	if (s && s->val->shown && s->val->shown_gen == display_gen &&
+			s->val->shown_mode == printmode) {
+		pf = s->val->shown;
+		if (!mpd_isfinite(m) || floating_mode(printmode)) {
+			p_printf("%*s%s\n", floating_alignment(pf), pf, mark);
+		} else {
+			p_printf("%*s", calc_align(0), pf);
+			show_int_truncation(0, m, mark);
+		}
+		return;
+	}
+
 	if (!mpd_isfinite(m) || floating_mode(printmode)) {
-		char *pf;
 		pf = print_floating(m, printmode);
+		if (s)
+			num_remember(s, pf, printmode);
 		align = floating_alignment(pf);
 		p_printf("%*s%s\n", align, pf, mark);
 		return;
@@ -2789,107 +4341,199 @@ print_n(mpd_t *m, int printmode, boolean conv, char *mark)
 	 * conversion alongside the converted value.  */
 
 	mpd_t *n = mpd_new(ctx);
-	switch (printmode) {
-	case 'H':
-		u = mpd_get_64_bits(&changed, n, m);
-		align = calc_align(0);
-		p_printf("%*s", align, puthex(u));
-		break;
-	case 'O':
-		u = mpd_get_64_bits(&changed, n, m);
-		align = calc_align(0);
-		p_printf("%*s", align, putoct(u));
-		break;
-	case 'B':
-		u = mpd_get_64_bits(&changed, n, m);
-		align = calc_align(0);
-		p_printf("%*s", align, putbinary(u));
-		break;
-	case 'U':
-		u = mpd_get_64_bits(&changed, n, m);
-		align = calc_align(0);
-		p_printf("%*s", align, putunsigned(u));
-		break;
-	case 'D':
-		u = mpd_get_64_bits(&changed, n, m);
-		align = calc_align(0);
-		/* shenanigans to make pos/neg numbers appear
-		 * properly.  our masked/shortened numbers
-		 * don't appear as negative to printf, so we
-		 * find the reduced-width sign bit, and fake
-		 * it.
-		 */
-
-		// long long mask;
-		ln = (ll_t)u;
-		// mask gives us everything but the sign bit
-		// mask = (long long)int_mask & ~int_sign_bit;
-		if (ln & int_sign_bit) {	// it's negative
-			ln |= ~int_mask;
-		} else {
-			ln &= int_mask;
-		}
-		p_printf("%*s", align, putsigned(ln));
-		break;
-	default:
+	mpd_get_limbs(u, int_limbs, &changed, n, m);
+	align = calc_align(0);
+	pf = int_string(u, printmode);
+	if (!pf) {
 		error(" bug: default case in print_n()\n");
+		mpd_del(n);
 		return;
 	}
+	p_printf("%*s", align, pf);
+	if (s && !changed)
+		num_remember(s, pf, printmode);
 
 	// p_printf("%s\n", mark);
 	show_int_truncation(changed, m, mark);
-	if (changed && conv)
+	if (changed && conv) {
+		if (s) {
+			num_forget(s);
+			m = num_own_value(s);
+		}
 		mpd_copy(m, n, ctx);
+	}
 	mpd_del(n);
 
 }
 
 void
-print_few_worker(int mode, struct num *s, int depth)
+print_n(mpd_t *m, int printmode, boolean conv, char *mark)
+{
+	print_num(m, NULL, printmode, conv, mark);
+}
+
+/* call fn for the top count entries of the stack s, starting with
+ * the deepest of them and working up to the top, which is the order
+ * they're displayed in.  n is an entry's position, counting up from
+ * the bottom of the whole stack.  the stack is only linked downward,
+ * and recursing to the bottom can overflow the C stack when the
+ * stack is very deep.  instead the links are reversed in place for
+ * the walk, and then put back.  fn must not change the stack.  */
+void
+stack_walk_up(struct num *s, int count,
+	void (*fn)(struct num *s, int n, void *arg), void *arg)
+{
+	struct num *prev = NULL, *next, *deepest;
+	int i, n;
+
+	for (i = 0; s && i < count; i++) {
+		next = s->next;
+		s->next = prev;
+		prev = s;
+		s = next;
+	}
+	if (!prev)
+		return;
+	deepest = prev;  // s is now whatever is below the walk
+
+	for (n = stack_count - i + 1; prev; prev = prev->next)
+		(*fn)(prev, n++, arg);
+
+	for (prev = s, s = deepest; i--; ) {
+		next = s->next;
+		s->next = prev;
+		prev = s;
+		s = next;
+	}
+}
+
+// ------------------------  machine-readable output
+
+/* write m as a single JSON or CSV value, with no alignment,
+ * separators, or decoration */
+void
+put_value(mpd_t *m, int printmode)
 {
-	if (s && depth) {
-		print_few_worker(mode, s->next, depth-1);
-		print_n(s->mpd, mode, 0, 0);
+	uint64_t u[MAX_LIMBS];
+	char *s, *raw = 0;
+	boolean seps = digitseparators;
+
+	if (json_output == 2 || csv_output == 2) {
+		s = raw = mpd_to_sci(m, 0);
+	} else {
+		digitseparators = FALSE;
+		if (!mpd_isfinite(m) || floating_mode(printmode)) {
+			s = print_floating(m, printmode);
+		} else {
+			mpd_get_limbs(u, int_limbs, 0, 0, m);
+			s = int_string(u, printmode);
+		}
+		digitseparators = seps;
+		if (!s)
+			s = "";
+		while (*s == ' ')
+			s++;
 	}
+
+	/* in JSON, only full precision finite values are bare numbers.
+	 * CSV only needs quotes if the locale uses a decimal comma.  */
+	if (json_output ? (!raw || !mpd_isfinite(m)) : !!strchr(s, ','))
+		printf("\"%s\"", s);
+	else
+		fputs(s, stdout);
+
+	if (raw)
+		mpd_free(raw);
+}
+
+void
+put_list_worker(struct num *s, int n, void *arg)
+{
+	(void)n;
+	if (*(int *)arg)
+		fputs(json_output ? ", " : ",", stdout);
+	*(int *)arg = 1;
+	put_value(s->val->mpd, mode);
+}
+
+/* the top count entries of the stack, deepest first, as a JSON
+ * array or a CSV row */
+void
+put_list(int count)
+{
+	int started = 0;
+
+	if (json_output)
+		putchar('[');
+	stack_walk_up(stack, count, put_list_worker, &started);
+	if (json_output)
+		putchar(']');
+}
+
+void
+print_few_worker(struct num *s, int n, void *arg)
+{
+	(void)n;
+	print_num(s->val->mpd, s, *(int *)arg, 0, 0);
 }
 
 void
 print_few(void)
 {
-	print_few_worker(mode, stack, autoprint);
+	if (json_output || csv_output) {
+		if (autoprint == 1 && stack)
+			put_value(stack->val->mpd, mode);
+		else
+			put_list(autoprint < 0 ? stack_count : autoprint);
+		putchar('\n');
+		return;
+	}
+	display_check();
+	stack_walk_up(stack, autoprint < 0 ? stack_count : autoprint,
+			print_few_worker, &mode);
 }
 
 void
 print_top(int printmode)
 {
+	if ((json_output || csv_output) && stack) {
+		put_value(stack->val->mpd, printmode);
+		putchar('\n');
+		return;
+	}
+	display_check();
 	if (stack)
-		print_n(stack->mpd, printmode, 0, 0);
+		print_num(stack->val->mpd, stack, printmode, 0, 0);
 }
 
 void
-printstack_worker(int n, boolean conv, struct num *s)
+printstack_worker(struct num *s, int n, void *arg)
 {
-
-	if (s->next)
-		printstack_worker(n-1, conv, s->next);
-
-	print_n(s->mpd, mode, conv,
+	print_num(s->val->mpd, s, mode, *(boolean *)arg,
 		(n == stack_mark) ? "         # <-  mark" : "");
 }
 
 void
 printstack(boolean conv, struct num *s)
 {
-	if (!s)
-		return;
-
-	printstack_worker(stack_count, conv, s);
+	/* converting changes the entries, so the snapshot and the
+	 * undo history can't be left sharing their nodes.  print_num()
+	 * copies only the values it changes.  */
+	if (conv && s == stack) {
+		stack_own(stack_count);
+		s = stack;
+	}
+	display_check();
+	stack_walk_up(s, stack_count, printstack_worker, &conv);
 }
 
 opreturn
 printall(void)
 {
-	printstack(0,stack);
+	/* the stack may be very large, so rather than accumulate it
+	 * all with the other pending output, it's written straight to
+	 * stdout by pending_show(), if it gets that far */
+	pending_stack = TRUE;
 	return GOODOP;
 }
 
@@ -2958,36 +4602,62 @@ printmax(void)
 
 // ------------------------  state and debug output
 
-// worker for printstate()
+// workers for printstate()
 void
-rawprintstack(int n, struct num *s, int is_stack)
+rawprintstack_worker(struct num *s, int n, void *arg)
 {
-	if (!s) {
-		p_printf("%16s\n", "<empty>");
+	char *pre = "        ";
+
+	if (arg) {	// the snapshot
+		p_printf("         %s\n", mpd(s->val->mpd));
 		return;
 	}
+	if (n == stack_count)
+		pre = "  top ->";
+	if (n == stack_mark) // mark takes precedence if set
+		pre = " mark ->";
+	p_printf("%s %s\n", pre, mpd(s->val->mpd));
+}
 
-	if (is_stack) {
-		if (s->next)
-			rawprintstack(n-1, s->next, is_stack);
+void
+rawprintstack(struct num *s, int is_stack)
+{
+	if (!s) {
+		p_printf("%16s\n", "<empty>");
+		return;
 	}
 
-	char *pre = "        ";
-	if (is_stack) {
-		if (n == stack_count)
-			pre = "  top ->";
-		if (n == stack_mark) // mark takes precedence if set
-			pre = " mark ->";
-	}
-	p_printf("%s %s", pre, mpd(s->mpd));
-	p_printf("\n");
-	if (!is_stack && s->next)
-		rawprintstack(n-1, s->next, is_stack);
+	if (is_stack)
+		stack_walk_up(s, stack_count, rawprintstack_worker, 0);
+	else
+		stack_walk_up(s, snapcount, rawprintstack_worker, &snapcount);
 }
 
 opreturn
 printstate(void)
 {
+	uint64_t bits[MAX_LIMBS];
+
+	if (json_output) {
+		printf("{\"mode\": \"%c\", \"format\": \"%s\", "
+			"\"digits\": %d, \"width\": %d, \"degrees\": %d, "
+			"\"depth\": %d, \"mark\": %d, \"stack\": ",
+			mode, float_specifier, float_digits, int_width,
+			trig_degrees, stack_count, stack_count - stack_mark);
+		put_list(stack_count);
+		puts("}");
+		return GOODOP;
+	}
+	if (csv_output) {
+		printf("mode,%c\nformat,%s\ndigits,%d\nwidth,%d\n"
+			"degrees,%d\ndepth,%d\nmark,%d\nstack%s",
+			mode, float_specifier, float_digits, int_width,
+			trig_degrees, stack_count, stack_count - stack_mark,
+			stack_count ? "," : "");
+		put_list(stack_count);
+		putchar('\n');
+		return GOODOP;
+	}
 
 	p_printf("\n");
 	p_printf(" Current mode is %c (%s)\n", mode,
@@ -2999,8 +4669,12 @@ printstate(void)
 
 	p_printf("  - when in integer modes,");
 	p_printf(" word width is %d bits\n", int_width);
-	p_printf("    mask: %s", puthex((ull_t)int_mask));
-	p_printf("  sign bit: %s\n", puthex((ull_t)int_sign_bit) );
+	memset(bits, 0xff, sizeof(bits));
+	limbs_mask(bits, int_limbs, int_width);
+	p_printf("    mask: %s", puthex(bits));
+	memset(bits, 0, sizeof(bits));
+	bits[(int_width - 1) / 64] = 1ULL << ((int_width - 1) % 64);
+	p_printf("  sign bit: %s\n", puthex(bits));
 	p_printf("    max integer width is %d bits\n", max_int_width);
 
 	p_printf("\n");
@@ -3017,11 +4691,10 @@ printstate(void)
 		p_printf("\n Full precision stack:\n");
 		p_printf("  stack count %d, depth of the stack mark is %d\n",
 			stack_count, stack_count - stack_mark);
-		rawprintstack(stack_count, s, 1);
+		rawprintstack(s, 1);
 
-		s = snapstack;
 		p_printf("\n Full precision snapshot:\n");
-		rawprintstack(stack_count, s, 0);
+		rawprintstack(snapcount ? snapstack : NULL, 0);
 
 		p_printf("temp buffer fill: %ld (of %ld)\n",
 				temp_buf_hiwater, TEMP_BUFSIZE);
@@ -3221,23 +4894,35 @@ digits(void)
 void
 setup_integer_width(int bits)
 {
+	mpd_ssize_t prec;
+
 	if (!bits || !max_int_width) {	/* first call */
-		max_int_width = LONGLONG_BITS;
-		bits = max_int_width;
+		max_int_width = MAX_INT_WIDTH;
+		bits = LONGLONG_BITS;
 		int_modulo = mpd_new(ctx);
 
 	}
 
+	int_width = bits;
+	int_limbs = (int_width + 63) / 64;
+
+	/* wide integers need more working precision than floating
+	 * point does.  a whole number of limbs, 2^(64*limbs), has
+	 * about 64*limbs*log10(2) digits.  */
+	prec = (mpd_ssize_t)(int_limbs * 64) * 30103 / 100000 + 2;
+	if (prec < MPDECIMAL_DIGITS)
+		prec = MPDECIMAL_DIGITS;
+	ctx->prec = prec;
+
 	// int_modulo used as tmp var here
 	mpd_set_i64(int_modulo, bits, ctx);
 	mpd_pow(int_modulo, two, int_modulo, ctx);   // 2 ^ bits
 
-	int_width = bits;
-	int_sign_bit = (1LL << (int_width - 1));
-
-	if (int_width == LONGLONG_BITS) {
+	if (int_width >= (int)LONGLONG_BITS) {
+		int_sign_bit = (ll_t)(1ULL << (LONGLONG_BITS - 1));
 		int_mask = ~0;
 	} else {
+		int_sign_bit = (1LL << (int_width - 1));
 		int_mask = (1LL << int_width) - 1;
 	}
 }
@@ -3254,7 +4939,7 @@ width(void)
 	bits = (int)mpd_get_u32(mbits, ctx);
 
 	if (bits == -1) {
-		bits = max_int_width;
+		bits = LONGLONG_BITS;
 	} else if (bits > max_int_width) {
 		bits = max_int_width;
 		p_printf(" Width out of range, set to max (%d)\n", bits);
@@ -3263,7 +4948,7 @@ width(void)
 		p_printf(" Width out of range, set to min (%d)\n", bits);
 	}
 
-	long long old_int_mask = int_mask;
+	int old_int_width = int_width;
 
 	setup_integer_width(bits);
 	mpd_del(mbits);
@@ -3275,17 +4960,24 @@ width(void)
 	} else {
 		// mask_stack();
 		struct num *s;
+		mpd_t *t = mpd_new(ctx);
+		stack_own(stack_count);
 		for (s = stack; s; s = s->next) {
-			uint64_t u = mpd_get_64_bits(0, 0, s->mpd);
+			uint64_t u[MAX_LIMBS];
+			mpd_get_limbs(u, int_limbs, 0, 0, s->val->mpd);
 			/* clear any old sign extension */
-			u &= (ull_t)old_int_mask;
+			limbs_mask(u, int_limbs, old_int_width);
+			mpd_set_limbs(t, u, int_limbs);
 			/* set new sign extension based on the new sign bit */
-			if (u & (ull_t)int_sign_bit) {
-				u |= ~(ull_t)int_mask;
+			if (limbs_field(u, int_width - 1, 1))
+				mpd_sub(t, t, int_modulo, ctx);
+			/* only the values that change are copied */
+			if (mpd_cmp_total(t, s->val->mpd) != 0) {
+				num_forget(s);
+				mpd_copy(num_own_value(s), t, ctx);
 			}
-			mpd_set_i64(s->mpd, (int64_t)u, ctx);
-
 		}
+		mpd_del(t);
 	}
 
 	return GOODOP;
@@ -3371,54 +5063,28 @@ mark(void)
 opreturn
 clearsnapshot(void)
 {
-	// clear existing snapstack
-	struct num *p;
-	while ((p = snapstack)) {
-		snapstack = p->next;
-		mpd_del(p->mpd);
-		free(p);
-	}
+	num_release(snapstack);
+	snapstack = NULL;
+	snapcount = 0;
 	return GOODOP;
 }
+
+/* the snapshot shares the stack's nodes, so taking one is just a
+ * matter of remembering where it starts, and how long it is. */
 opreturn
 snapshot(void)
 {
-	struct num *p;
-
 	if (stack_count <= stack_mark) {
 		error(" error: nothing to snapshot\n");
 		return BADOP;
 	}
 
-	p = stack;
-	if (!p) { // if stack count/mark are correct, this can't happen
-		error(" empty stack\n");
-		return BADOP;
-	}
-
 	clearsnapshot();
+	snapstack = stack;
+	num_hold(snapstack);
+	snapcount = stack_count - stack_mark;
 
-	// copy (as much as we want of the) real stack to snapstack
-	p = stack;
-	snapstack = NULL;
-	int i = 0;
-	int n = stack_count;
-	while (n > stack_mark) {
-		struct num *np;
-
-		// push a new copy of the entry on snapstack
-		np = (struct num *)safe_calloc(sizeof(struct num));
-		np->mpd = mpd_new(ctx);
-		mpd_copy(np->mpd, p->mpd, ctx);
-		np->next = snapstack;
-		snapstack = np;
-
-		// next item from "real" stack
-		p = p->next;
-		n--;
-		i++;
-	}
-	p_printf(" Made snapshot of %d stack entries\n", i);
+	p_printf(" Made snapshot of %d stack entries\n", snapcount);
 
 	return GOODOP;
 }
@@ -3426,20 +5092,125 @@ snapshot(void)
 opreturn
 restore(void)
 {
-	struct num *p = snapstack;
-	int i = 0;
-	mpd_t *n;
+	struct num *p, **v;
+	int i;
 
 	stack_mark = stack_count;
 
-	while (p) {
-		n = mpd_new(ctx);
-		mpd_copy(n, p->mpd, ctx);
-		mpush(n);
+	for (i = 0, p = snapstack; i < snapcount; i++)
 		p = p->next;
-		i++;
+
+	if (p == stack) {
+		/* the snapshot already sits on the current stack (e.g.,
+		 * a whole-stack snapshot, restored after a clear), so it
+		 * can simply become the stack again */
+		num_hold(snapstack);
+		num_release(stack);
+		stack = snapstack;
+		stack_count += snapcount;
+	} else if (snapcount > 0) {
+		// otherwise push copies, deepest first
+		v = (struct num **)scratch_alloc((size_t)snapcount * sizeof(*v));
+		for (i = 0, p = snapstack; i < snapcount; i++, p = p->next)
+			v[i] = p;
+		while (i--)
+			mpush_copy(v[i]->val->mpd);
+	}
+	p_printf(" Restored %d stack entries\n", snapcount);
+	return GOODOP;
+}
+
+/* undo history:  the stack as it was at the end of each of the last
+ * UNDO_LEVELS input lines.  since stack lists are shared, each of
+ * these is just another reference to a stack.  history_pos is the
+ * one that matches the current stack, if nothing's changed since.
+ * a reordered stack shares values but not nodes, so the levels are
+ * also limited to UNDO_ENTRIES stack entries in all, counting each
+ * level's entries whether they're shared or not.  */
+#define UNDO_LEVELS 100
+#define UNDO_ENTRIES 1000000
+struct checkpoint {
+	struct num *stack;
+	int count;
+	int mark;
+} history[UNDO_LEVELS];
+int history_len, history_pos;
+long history_entries;
+
+boolean
+at_checkpoint(void)
+{
+	struct checkpoint *c = &history[history_pos];
+
+	return history_len && c->stack == stack &&
+		c->count == stack_count && c->mark == stack_mark;
+}
+
+/* called at the end of every line */
+void
+checkpoint(void)
+{
+	struct checkpoint *c;
+
+	if (at_checkpoint())
+		return;
+
+	// a change after an undo discards what could have been redone
+	while (history_len > history_pos + 1) {
+		c = &history[--history_len];
+		num_release(c->stack);
+		history_entries -= c->count;
+	}
+
+	// make room, dropping the oldest levels
+	while (history_len == UNDO_LEVELS || (history_len &&
+			history_entries + stack_count > UNDO_ENTRIES)) {
+		num_release(history[0].stack);
+		history_entries -= history[0].count;
+		memmove(&history[0], &history[1],
+			(size_t)(history_len - 1) * sizeof(history[0]));
+		history_len--;
 	}
-	p_printf(" Restored %d stack entries\n", i);
+
+	c = &history[history_len];
+	c->stack = stack;
+	num_hold(stack);
+	c->count = stack_count;
+	c->mark = stack_mark;
+	history_entries += stack_count;
+	history_pos = history_len++;
+}
+
+void
+goto_checkpoint(struct checkpoint *c)
+{
+	num_hold(c->stack);
+	num_release(stack);
+	stack = c->stack;
+	stack_count = c->count;
+	stack_mark = c->mark;
+}
+
+opreturn
+undo(void)
+{
+	checkpoint();  // so changes made on this line can be redone
+	if (history_pos == 0) {
+		error(" error: nothing to undo\n");
+		return BADOP;
+	}
+	goto_checkpoint(&history[--history_pos]);
+	return GOODOP;
+}
+
+opreturn
+redo(void)
+{
+	if (!at_checkpoint() || history_pos + 1 >= history_len) {
+		error(" error: nothing to redo\n");
+		return BADOP;
+	}
+	goto_checkpoint(&history[++history_pos]);
 	return GOODOP;
 }
 
@@ -3464,25 +5235,59 @@ sum_worker(boolean do_sum)
 	tot_sq = mpd_new(ctx);
 	mpd_set_i64(tot_sq, 0, ctx);
 	int i = 0;
+
+#ifdef HAVE_CURRENCY_ENGINE
+	/* in currency mode, sums are kept in minor units for as long as
+	 * they fit, and moved to tot if they stop fitting */
+	int64_t ctot = 0, v, t;
+	boolean native = (mode == 'C' && do_sum != 3 && cur_scale());
+#endif
+
 	while (stack_count > stack_mark) {
 		if (!mpop(&a)) {
 			fprintf(stderr, "bailing in sum_worker\n");
 			goto cleanup;
 		}
+		i++;
+#ifdef HAVE_CURRENCY_ENGINE
+		if (native) {
+			if (cur_get(a, &v) &&
+					!__builtin_add_overflow(ctot, v, &t)) {
+				ctot = t;
+				mpd_del(a);
+				continue;
+			}
+			native = FALSE;
+			cur_set(tot, ctot);
+		}
+#endif
 		// tot += a
 		mpd_add(tot, tot, a, ctx);
-		// tot_sq += (a * a)
-		mpd_mul(a, a, a, ctx);
-		mpd_add(tot_sq, tot_sq, a, ctx);
+		if (do_sum == 3) {
+			// tot_sq += (a * a)
+			mpd_mul(a, a, a, ctx);
+			mpd_add(tot_sq, tot_sq, a, ctx);
+		}
 		mpd_del(a);
-		i++;
 	}
 	mpd_set_i64(n, i, ctx);
 
-	switch (do_sum) {
-	case 1: // sum
-		mpush_copy(tot);
-		p_printf(" Summed %d stack entries\n", i);
+#ifdef HAVE_CURRENCY_ENGINE
+	if (native) {
+		cur_set(tot, ctot);
+		if (do_sum == 2 && cur_divround(ctot, i, &v)) {
+			cur_set(n, v);
+			mpush_copy(n);
+			p_printf(" Averaged %d stack entries\n", i);
+			goto cleanup;
+		}
+	}
+#endif
+
+	switch (do_sum) {
+	case 1: // sum
+		mpush_copy(tot);
+		p_printf(" Summed %d stack entries\n", i);
 		break ;;
 	case 2: // average
 		mpd_div(n, tot, n, ctx);
@@ -3536,6 +5341,386 @@ stddev(void)
 	return sum_worker(3);
 }
 
+/* order statistics.  the entries down to the mark are popped into
+ * an array, and only partitioned as far as is needed to find the
+ * wanted ranks:  quickselect, extended to several ranks at once.  */
+
+static void
+select_swap(mpd_t **v, int i, int j)
+{
+	mpd_t *t = v[i];
+	v[i] = v[j];
+	v[j] = t;
+}
+
+/* partially order v[lo..hi] so that each of the (sorted) ranks[0..nr-1]
+ * holds the value it would hold if v were sorted */
+void
+multiselect(mpd_t **v, int lo, int hi, int *ranks, int nr)
+{
+	int i, j, k;
+	mpd_t *pivot;
+
+	while (nr && lo < hi) {
+		// median of three for the pivot, left at v[lo]
+		int mid = lo + (hi - lo) / 2;
+		if (mpd_cmp_total(v[mid], v[lo]) < 0)
+			select_swap(v, mid, lo);
+		if (mpd_cmp_total(v[hi], v[lo]) < 0)
+			select_swap(v, hi, lo);
+		if (mpd_cmp_total(v[hi], v[mid]) < 0)
+			select_swap(v, hi, mid);
+		select_swap(v, lo, mid);
+		pivot = v[lo];
+
+		// hoare partition:  v[lo..j] <= pivot <= v[j+1..hi]
+		i = lo;
+		j = hi + 1;
+		for (;;) {
+			while (mpd_cmp_total(v[++i], pivot) < 0 && i < hi)
+				;
+			while (mpd_cmp_total(v[--j], pivot) > 0)
+				;
+			if (i >= j)
+				break;
+			select_swap(v, i, j);
+		}
+		select_swap(v, lo, j);	// the pivot is now in its place
+
+		// ranks below j go left, above j go right
+		for (k = 0; k < nr && ranks[k] < j; k++)
+			;
+		if (k < nr && ranks[k] == j) {
+			multiselect(v, j + 1, hi, ranks + k + 1, nr - k - 1);
+			nr = k;
+			hi = j - 1;
+			continue;
+		}
+		// recurse on the smaller side, loop on the other
+		if (k < nr - k) {
+			multiselect(v, lo, j - 1, ranks, k);
+			ranks += k;
+			nr -= k;
+			lo = j + 1;
+		} else {
+			multiselect(v, j + 1, hi, ranks + k, nr - k);
+			nr = k;
+			hi = j - 1;
+		}
+	}
+}
+
+int
+rank_compare(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* the p'th percentile of v[0..n-1] (sorted), interpolating linearly
+ * between the two closest ranks, like most spreadsheets do */
+void
+percentile_of(mpd_t *r, mpd_t **v, int n, int lo, mpd_t *frac)
+{
+	mpd_t *t;
+
+	if (mpd_iszero(frac) || lo + 1 >= n) {
+		mpd_copy(r, v[lo], ctx);
+		return;
+	}
+	t = mpd_new(ctx);
+	mpd_sub(t, v[lo + 1], v[lo], ctx);
+	mpd_fma(r, t, frac, v[lo], ctx);  // v[lo] + frac * (v[lo+1] - v[lo])
+	mpd_del(t);
+}
+
+/* rank (floor) and fractional part for the p'th percentile of n values */
+boolean
+percentile_rank(mpd_t *p, int n, int *rank, mpd_t *frac)
+{
+	mpd_t *h;
+
+	if (mpd_isspecial(p) || mpd_isnegative(p) ||
+			mpd_cmp(p, hundred, ctx) > 0) {
+		error(" error: percentile must be between 0 and 100\n");
+		return 0;
+	}
+	h = mpd_new(ctx);
+	mpd_set_i64(h, n - 1, ctx);
+	mpd_mul(h, h, p, ctx);
+	mpd_div(h, h, hundred, ctx);	// h = (n - 1) * p / 100
+	mpd_floor(frac, h, ctx);
+	*rank = (int)mpd_get_i64(frac, ctx);
+	mpd_sub(frac, h, frac, ctx);
+	mpd_del(h);
+	return 1;
+}
+
+enum order_stat { O_MIN, O_MAX, O_MEDIAN, O_PERCENTILE, O_PERCENTILES };
+
+opreturn
+order_worker(enum order_stat which)
+{
+	mpd_t **v, **pcts = NULL, *frac, *r;
+	int *ranks = NULL, *lows = NULL;
+	int n, i, u, np = 1, nr = 0;
+	mpd_t *a, *count = NULL;
+	int64_t c;
+	opreturn ret = BADOP;
+
+	if (which == O_PERCENTILES) {
+		// the count of percentiles, and then the percentiles
+		if (!mpop(&count))
+			return BADOP;
+		if (!mpd_get_count(count, &c) || c < 1 ||
+				c > stack_count - stack_mark - 1) {
+			error(" error: bad percentile count (%s)\n",
+				mpd(count));
+			mpush(count);
+			return BADOP;
+		}
+		np = (int)c;
+		pcts = (mpd_t **)scratch_alloc((size_t)np * sizeof(*pcts));
+		for (i = np - 1; i >= 0; i--)
+			mpop(&pcts[i]);
+	} else if (which == O_PERCENTILE) {
+		if (stack_count - stack_mark < 2) {
+			error(" error: empty stack, or at mark?\n");
+			return BADOP;
+		}
+		pcts = (mpd_t **)scratch_alloc(sizeof(*pcts));
+		mpop(&pcts[0]);
+	} else if (which == O_MEDIAN) {
+		pcts = (mpd_t **)scratch_alloc(sizeof(*pcts));
+		pcts[0] = mpd_new(ctx);
+		mpd_set_i64(pcts[0], 50, ctx);
+	}
+
+	if (stack_count <= stack_mark) {
+		error(" error: empty stack, or at mark?\n");
+		goto out;
+	}
+
+	n = stack_count - stack_mark;
+	frac = mpd_new(ctx);
+
+	if (pcts) {
+		lows = (int *)scratch_alloc((size_t)np * sizeof(*lows));
+		ranks = (int *)scratch_alloc((size_t)np * 2 * sizeof(*ranks));
+		for (i = 0; i < np; i++) {
+			if (!percentile_rank(pcts[i], n, &lows[i], frac)) {
+				mpd_del(frac);
+				goto out;
+			}
+			ranks[nr++] = lows[i];
+			if (!mpd_iszero(frac) && lows[i] + 1 < n)
+				ranks[nr++] = lows[i] + 1;
+		}
+	}
+
+	// save a  snapshot, but don't overwrite existing
+	if (!snapstack)
+		snapshot();
+
+	v = (mpd_t **)scratch_alloc((size_t)n * sizeof(*v));
+	for (i = 0; i < n; i++)
+		mpop(&v[i]);
+
+	r = mpd_new(ctx);
+	switch (which) {
+	case O_MIN:
+	case O_MAX:
+		// one pass
+		a = v[0];
+		for (i = 1; i < n; i++) {
+			int c = mpd_cmp_total(v[i], a);
+			if ((which == O_MIN) ? (c < 0) : (c > 0))
+				a = v[i];
+		}
+		mpush_copy(a);
+		p_printf(" Found the %s of %d stack entries\n",
+			(which == O_MIN) ? "minimum" : "maximum", n);
+		break;
+	default:
+		qsort(ranks, (size_t)nr, sizeof(*ranks), rank_compare);
+		for (i = 1, u = 1; i < nr; i++)	// drop duplicates
+			if (ranks[i] != ranks[u - 1])
+				ranks[u++] = ranks[i];
+		multiselect(v, 0, n - 1, ranks, u);
+		for (i = 0; i < np; i++) {
+			percentile_rank(pcts[i], n, &lows[i], frac);
+			percentile_of(r, v, n, lows[i], frac);
+			mpush_copy(r);
+		}
+		if (which == O_MEDIAN)
+			p_printf(" Found the median of %d stack entries\n", n);
+		else
+			p_printf(" Found %d percentile%s of %d stack entries\n",
+				np, np == 1 ? "" : "s", n);
+		break;
+	}
+
+	for (i = 0; i < n; i++)
+		mpd_del(v[i]);
+	mpd_del(r);
+	mpd_del(frac);
+	ret = GOODOP;
+    out:
+	// on error, the operands go back where they were
+	if (pcts) {
+		for (i = 0; i < np; i++) {
+			if (ret == BADOP && which != O_MEDIAN)
+				mpush(pcts[i]);
+			else
+				mpd_del(pcts[i]);
+		}
+	}
+	if (count) {
+		if (ret == BADOP)
+			mpush(count);
+		else
+			mpd_del(count);
+	}
+	return ret;
+}
+
+opreturn
+smallest(void)
+{
+	return order_worker(O_MIN);
+}
+
+opreturn
+largest(void)
+{
+	return order_worker(O_MAX);
+}
+
+opreturn
+median(void)
+{
+	return order_worker(O_MEDIAN);
+}
+
+opreturn
+percentile(void)
+{
+	return order_worker(O_PERCENTILE);
+}
+
+opreturn
+percentiles(void)
+{
+	return order_worker(O_PERCENTILES);
+}
+
+/* numeric ordering, without the allocation mpd_cmp() can need when
+ * exponents differ:  sign first, then magnitude by adjusted exponent,
+ * and only then the coefficients.  NaNs sort above everything.  */
+int
+num_compare(const mpd_t *a, const mpd_t *b)
+{
+	int sa, sb, c;
+
+	if (mpd_isnan(a) || mpd_isnan(b))
+		return mpd_isnan(a) - mpd_isnan(b);
+
+	sa = mpd_iszero(a) ? 0 : (mpd_isnegative(a) ? -1 : 1);
+	sb = mpd_iszero(b) ? 0 : (mpd_isnegative(b) ? -1 : 1);
+	if (sa != sb)
+		return sa - sb;
+	if (sa == 0)
+		return 0;
+
+	// same sign:  compare magnitudes, and flip them if negative
+	if (mpd_isinfinite(a) || mpd_isinfinite(b))
+		c = mpd_isinfinite(a) - mpd_isinfinite(b);
+	else if (mpd_adjexp(a) != mpd_adjexp(b))
+		c = (mpd_adjexp(a) > mpd_adjexp(b)) ? 1 : -1;
+	else
+		return mpd_cmp(a, b, ctx);  // same scale:  just the digits
+
+	return c * sa;
+}
+
+int
+sort_compare(const void *a, const void *b)
+{
+	return num_compare((*(struct num * const *)b)->val->mpd,
+			(*(struct num * const *)a)->val->mpd);
+}
+
+int
+rsort_compare(const void *a, const void *b)
+{
+	return sort_compare(b, a);
+}
+
+/* sort the entries above the mark, by sorting an array of pointers
+ * to their nodes, and relinking them.  the largest ends up on top. */
+opreturn
+sort_worker(int (*compare)(const void *, const void *))
+{
+	struct num **v, *p;
+	int n, i;
+
+	n = stack_count - stack_mark;
+	if (n < 2)
+		return GOODOP;
+
+	v = (struct num **)scratch_alloc((size_t)n * sizeof(*v));
+	stack_own(n);
+	for (i = 0, p = stack; i < n; i++, p = p->next)
+		v[i] = p;
+
+	qsort(v, (size_t)n, sizeof(*v), compare);
+
+	for (i = 0; i < n - 1; i++)
+		v[i]->next = v[i + 1];
+	v[n - 1]->next = p;
+	stack = v[0];
+
+	p_printf(" Sorted %d stack entries\n", n);
+	return GOODOP;
+}
+
+opreturn
+sort(void)
+{
+	return sort_worker(sort_compare);
+}
+
+opreturn
+rsort(void)
+{
+	return sort_worker(rsort_compare);
+}
+
+/* drop adjacent equal entries above the mark */
+opreturn
+uniq(void)
+{
+	struct num *p, *q;
+	int n, dropped = 0;
+
+	n = stack_count - stack_mark;
+	stack_own(n);
+	p = stack;
+	while (n-- > 1) {
+		q = p->next;
+		if (num_compare(p->val->mpd, q->val->mpd) == 0) {
+			p->next = q->next;
+			val_release(q->val);
+			num_free(q);
+			stack_count--;
+			dropped++;
+		} else {
+			p = q;
+		}
+	}
+	p_printf(" Removed %d duplicate stack entries\n", dropped);
+	return GOODOP;
+}
+
 // ------------------------     unit conversions
 
 opreturn
@@ -3730,7 +5915,7 @@ mpd_to_ldouble(ldouble *dp, mpd_t *m)
 
 	int ok = ((*es == '\0') && (errno == 0));
 
-	free(s);
+	mpd_free(s);
 
 	return ok;
 }
@@ -3837,17 +6022,16 @@ tpush(token **tstackp, token *tok)
 	// trace(EXEC, "tpushing on %s\n", stackname(tstackp));
 
 	/* we may be asked to push a static or local token.  so if we
-	 * originally malloc'ed the incoming token, just reuse it,
-	 * otherwise malloc and copy.  */
+	 * originally allocated the incoming token, just reuse it,
+	 * otherwise copy it to scratch space, where it lasts until the
+	 * end of the line.  its valstr is already there.  */
 	if (tok->alloced) {
 		t = tok;
 	} else {
-		t = (struct token *)safe_calloc(sizeof(struct token));
+		t = (struct token *)scratch_alloc(sizeof(struct token));
 		*t = *tok;
-		if (tok->valstr)
-			t->valstr = strdup(tok->valstr);
 		if (tok->mpd) {
-			t->mpd = mpd_new(ctx);
+			t->mpd = mpd_new_inline();
 			mpd_copy(t->mpd, tok->mpd, ctx);
 		}
 		t->alloced = 1;
@@ -3878,32 +6062,17 @@ tpop(token **tstackp)
 	return rt;
 }
 
+/* tokens and their strings are scratch space, and go away at the
+ * end of the line.  only a token's number needs freeing. */
 void
 tfree(token *t)
 {
 	if (!t) return;
 
-	if (t->valstr) {
-		free(t->valstr);
-		t->valstr = 0;
-	}
 	if (t->mpd) {
 		mpd_del(t->mpd);
 		t->mpd = 0;
 	}
-
-	if (!t->alloced) {
-		return;
-	}
-
-	/* we can suppress this warning because the check above keeps
-	 * us from freeing static tokens */
-DIAG_PUSH
-DIAG_IGNORE( GCC diagnostic ignored "-Wfree-nonheap-object" )
-
-	free(t);
-
-DIAG_POP
 }
 
 void
@@ -3932,7 +6101,13 @@ sprint_token(char *s, size_t slen, token *t)
 
 	switch (t->type) {
 	case NUMERIC:
-		snprintf(s, slen, "'%s'", t->valstr);
+		if (t->valstr) {
+			snprintf(s, slen, "'%s'", t->valstr);
+		} else {  // a calculated number, or the text wasn't kept
+			char *v = mpd_to_sci(t->mpd, 0);
+			snprintf(s, slen, "'%s'", v);
+			mpd_free(v);
+		}
 		break;
 	case SYMBOLIC:
 		snprintf(s, slen, "'%s'", t->oper->name);
@@ -3943,6 +6118,12 @@ sprint_token(char *s, size_t slen, token *t)
 	case OP:
 		snprintf(s, slen, "'%s'", t->oper->name);
 		break;
+	case TEMPSTORE:
+		snprintf(s, slen, "'=tmp%d'", t->slot);
+		break;
+	case TEMPLOAD:
+		snprintf(s, slen, "'tmp%d'", t->slot);
+		break;
 	case EOL:
 		snprintf(s, slen, "'EOL'");
 		break;
@@ -4028,10 +6209,10 @@ semicolon(void)
 	 *      y x ;  discards x, just as pop would
 	 */
 	mpd_t *x;
-	mpop(&x);
-	mpd_free_before_copy(&lastx, x, ctx);
-	mpd_free_before_copy(&frozen_lastx, x, ctx);
-	mpd_del(x);
+	if (!mpop(&x))
+		return BADOP;
+	mpd_copy(frozen_lastx, x, ctx);
+	mpd_del(move_lastx(x));
 	return GOODOP;
 }
 
@@ -4095,6 +6276,9 @@ shunting_yard(int command)
 	token *tp; // used for tpeek()
 	opreturn open_paren(void);
 	opreturn assignment(void);
+	void fold_constants(token **queuep);
+	void common_subexpressions(token **queuep);
+	void compile_program(token **queuep);
 
 	if (!open_paren_token.oper) {
 		/* we need a couple of pre-parsed tokens */
@@ -4162,7 +6346,7 @@ shunting_yard(int command)
 		case EOL:
 			if (prev_tok_was_semicolon(pt)) {
 				// ';' is a no-op at EOL
-				free(tpop(&out_stack));
+				tfree(tpop(&out_stack));
 			} else if (!prev_tok_was_operand(pt)) {
 				expression_error(pt, t);
 				input_ptr = NULL;
@@ -4206,7 +6390,7 @@ shunting_yard(int command)
 
 				if (prev_tok_was_semicolon(pt)) {
 					// ';' is a no-op if followed by ')'
-					free(tpop(&out_stack));
+					tfree(tpop(&out_stack));
 				} else if (!prev_tok_was_operand(pt)) {
 					expression_error(pt, t);
 					input_ptr = NULL;
@@ -4224,7 +6408,7 @@ shunting_yard(int command)
 				}
 
 				// Pop the opening parenthesis
-				free(tpop(&oper_stack));
+				tfree(tpop(&oper_stack));
 
 				/* if the parenthesized expression was
 				 * an operand for a unary operator
@@ -4378,131 +6562,2097 @@ shunting_yard(int command)
 	trace(TOK|SHUNT, "\n");
 	trace_stack_dump(TOK|SHUNT, &infix_rpn_queue);
 
+	fold_constants(&infix_rpn_queue);
+	common_subexpressions(&infix_rpn_queue);
+
+	trace(SHUNT, "\n optimized:\n");
+	trace_stack_dump(SHUNT, &infix_rpn_queue);
+
+	compile_program(&infix_rpn_queue);
+
 	return GOODOP;
 
 #undef t_op
 #undef tp_op
 }
 
-opreturn
-open_paren(void)
+opreturn
+open_paren(void)
+{
+	return shunting_yard(1);
+}
+
+// ------------------------    infix optimization
+
+/* The rpn produced by the shunting yard is a literal translation of
+ * the expression.  Before it runs, we fold the parts of it that only
+ * depend on constants, by simply running them, here and now.  The
+ * mode, precision, and angle units are the same now as they will be
+ * when the rest of the expression runs, so the results are identical.
+ */
+
+boolean
+is_constant_token(token *t)
+{
+	if (t->type == NUMERIC)
+		return TRUE;
+	if (t->type == SYMBOLIC &&
+		(t->oper->func == push_pi || t->oper->func == push_e))
+		return TRUE;
+	return FALSE;
+}
+
+/* run the operator on its constant operands, saving and restoring
+ * lastx and lasty around it.  returns the result, or NULL if the
+ * operation failed or complained.  in that case it will be done for
+ * real later, complaints and all.  */
+mpd_t *
+fold_op(token **operands, int n, token *op)
+{
+	mpd_t *save_lastx = lastx, *save_lasty = lasty;
+	mpd_t *r = NULL, *x;
+	int base = stack_count;
+	opreturn ret;
+	int i;
+
+	lastx = mpd_new(ctx);
+	mpd_copy(lastx, zero, ctx);
+	lasty = mpd_new(ctx);
+	mpd_copy(lasty, zero, ctx);
+
+	suppress_errors = TRUE;
+	suppressed_errors = 0;
+
+	for (i = 0; i < n; i++) {
+		if (operands[i]->type == NUMERIC)
+			mpush_copy(operands[i]->mpd);
+		else
+			(operands[i]->oper->func) ();
+	}
+	ret = (op->oper->func) ();
+
+	if (ret == GOODOP && !suppressed_errors && stack_count == base + 1)
+		mpop(&r);
+
+	while (stack_count > base) {
+		mpop(&x);
+		mpd_del(x);
+	}
+
+	suppress_errors = FALSE;
+
+	mpd_del(lastx);
+	mpd_del(lasty);
+	lastx = save_lastx;
+	lasty = save_lasty;
+
+	return r;
+}
+
+/* is lastx going to be set again by a ';', before anything looks
+ * at it? */
+boolean
+lastx_overwritten(token *t)
+{
+	for (; t && t->type != EOL; t = t->next) {
+		if (t->type == SYMBOLIC && (t->oper->func == push_lastx ||
+				t->oper->func == push_lasty))
+			return FALSE;
+		if (t->type == OP && t->oper->func == semicolon)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+void
+fold_constants(token **queuep)
+{
+	/* a simulation of the operand stack.  each entry is the link
+	 * to the token that produced a constant operand, or NULL if the
+	 * operand won't be known until the expression runs.  */
+	static token ***sim;
+	static int simsize;
+	int depth = 0, assigning = 0, n, i;
+	token **lp, *t, *after, *operands[2];
+	mpd_t *r;
+	opreturn assignment(void);
+	opreturn call_function(void);
+
+	for (lp = queuep; (t = *lp) && t->type != EOL; lp = &t->next) {
+
+		if (depth + 1 > simsize) {
+			simsize = simsize ? simsize * 2 : 16;
+			sim = (token ***)realloc(sim, (size_t)simsize * sizeof(*sim));
+			if (!sim) {
+				perror("rca: realloc failed");
+				exit(3);
+			}
+		}
+
+		switch (t->type) {
+		case NUMERIC:
+		case SYMBOLIC:
+			sim[depth++] = is_constant_token(t) ? lp : NULL;
+			continue;
+
+		case VARIABLE:
+			if (assigning) {  // "= _a" stores, and pushes nothing
+				assigning = 0;
+				continue;
+			}
+			sim[depth++] = NULL;
+			continue;
+
+		case OP:
+			break;
+
+		default:
+			return;
+		}
+
+		/* after assignments and ';', the operands are no longer
+		 * adjacent to one another.  forget about all of them. */
+		if (t->oper->func == assignment) {
+			assigning = 1;
+			for (i = 0; i < depth; i++)
+				sim[i] = NULL;
+			continue;
+		}
+		if (t->oper->func == semicolon) {
+			if (depth)
+				depth--;
+			for (i = 0; i < depth; i++)
+				sim[i] = NULL;
+			continue;
+		}
+
+		n = t->oper->operands;
+		if ((n != 1 && n != 2) || depth < n)
+			return;  // not something we understand
+
+		depth -= n;
+		if (t->oper->func == call_function) {
+			// may have side effects, so always run it for real
+			sim[depth++] = NULL;
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			if (!sim[depth + i])
+				break;
+			operands[i] = *sim[depth + i];
+		}
+		if (i < n || operands[n - 1]->next != t ||
+				(n == 2 && operands[0]->next != operands[1])) {
+			sim[depth++] = NULL;
+			continue;
+		}
+
+		if (!(r = fold_op(operands, n, t))) {
+			sim[depth++] = NULL;
+			continue;
+		}
+
+		trace(SHUNT, " folded %s\n", t->oper->name);
+
+		/* the first operand's token becomes the result, and the
+		 * rest of the operand tokens, and the operator, go away */
+		after = t->next;
+		t = operands[0];
+		if (t->mpd)
+			mpd_del(t->mpd);
+		t->type = NUMERIC;
+		t->mpd = r;
+		t->valstr = NULL;
+		t->oper = NULL;
+		t->imode = 0;	// not "typed in", so autoprint shows it
+
+		while (t->next != after) {
+			token *dead = t->next;
+			t->next = dead->next;
+			tfree(dead);
+		}
+
+		lp = sim[depth++];
+	}
+
+	/* a constant that's immediately discarded with ';' only matters
+	 * because it sets lastx.  if another ';' will set it again, with
+	 * no use of lastx in between, the pair does nothing at all.  */
+	for (lp = queuep; (t = *lp) && t->type != EOL; ) {
+		token *s = t->next;
+		if (is_constant_token(t) && s && s->type == OP &&
+				s->oper->func == semicolon &&
+				lastx_overwritten(s->next)) {
+			trace(SHUNT, " dropped no-op ';'\n");
+			*lp = s->next;
+			tfree(t);
+			tfree(s);
+			continue;
+		}
+		lp = &t->next;
+	}
+}
+
+/* Common subexpressions:  an expression like
+ *	(sqrt(_a*_a + _b*_b) / (_a*_a + _b*_b))
+ * needn't calculate "_a*_a + _b*_b" twice.  We rebuild the expression
+ * tree from the rpn, and find repeated subtrees.  The first time one
+ * is evaluated its value is saved in a hidden temporary, and later
+ * occurrences simply push that value.  Only expressions without side
+ * effects qualify:  nothing is assigned, and nothing is discarded
+ * with ';' (which changes lastx).  */
+
+typedef struct exprnode {
+	token *tok;
+	struct exprnode *kid[2];
+	int nkids;
+	int size;	/* number of tokens in this subtree */
+	int order;	/* position of tok in the rpn */
+	char *key;	/* canonical text of this subtree */
+	int slot;	/* for a temporary:  slot+1 to store, -(slot+1) to load */
+} exprnode;
+
+mpd_t **cse_temps;
+int cse_ntemps;
+
+/* the first temporary an expression may use.  the ones below it
+ * belong to user defined functions, which can run in the middle of
+ * another expression.  */
+int cse_base;
+
+void
+temp_store(int slot)
+{
+	mpd_t *x;
+
+	if (mpeek(&x))
+		mpd_copy(cse_temps[slot], x, ctx);
+}
+
+void
+temp_load(int slot)
+{
+	mpush_copy(cse_temps[slot]);
+}
+
+char *
+exprnode_key(exprnode *n)
+{
+	char *s, *k0 = "", *k1 = "";
+	size_t len;
+
+	switch (n->tok->type) {
+	case NUMERIC:
+		s = mpd_to_sci(n->tok->mpd, 0);
+		len = strlen(s) + 2;
+		n->key = safe_calloc(len);
+		snprintf(n->key, len, "N%s", s);
+		mpd_free(s);
+		return n->key;
+	case VARIABLE:
+		len = strlen(n->tok->valstr) + 2;
+		n->key = safe_calloc(len);
+		snprintf(n->key, len, "V%s", n->tok->valstr);
+		return n->key;
+	}
+
+	if (n->nkids > 0) k0 = n->kid[0]->key;
+	if (n->nkids > 1) k1 = n->kid[1]->key;
+	len = strlen(n->tok->oper->name) + strlen(k0) + strlen(k1) + 8;
+	n->key = safe_calloc(len);
+	snprintf(n->key, len, "%s(%s,%s)", n->tok->oper->name, k0, k1);
+	return n->key;
+}
+
+/* visit the live subtrees (those not replaced by a temporary) that
+ * match key, and which haven't already been given a slot.  returns
+ * the count, and the earliest one evaluated in *firstp.  */
+int
+exprnode_matches(exprnode *n, char *key, exprnode **firstp)
+{
+	int i, count = 0;
+
+	if (n->slot < 0)
+		return 0;
+
+	if (!n->slot && !strcmp(n->key, key)) {
+		if (!*firstp || n->order < (*firstp)->order)
+			*firstp = n;
+		return 1;
+	}
+
+	for (i = 0; i < n->nkids; i++)
+		count += exprnode_matches(n->kid[i], key, firstp);
+
+	return count;
+}
+
+void
+exprnode_mark(exprnode *n, char *key, int slot)
+{
+	int i;
+
+	if (n->slot < 0)
+		return;
+
+	if (!n->slot && !strcmp(n->key, key)) {
+		n->slot = -slot;
+		return;
+	}
+
+	for (i = 0; i < n->nkids; i++)
+		exprnode_mark(n->kid[i], key, slot);
+}
+
+/* find the biggest repeated subtree that hasn't been dealt with */
+void
+exprnode_biggest_repeat(exprnode *root, exprnode *n, exprnode **bestp)
+{
+	exprnode *first = NULL;
+	int i;
+
+	if (n->slot)
+		return;
+
+	if (n->nkids && (!*bestp || n->size > (*bestp)->size) &&
+			exprnode_matches(root, n->key, &first) > 1)
+		*bestp = n;
+
+	for (i = 0; i < n->nkids; i++)
+		exprnode_biggest_repeat(root, n->kid[i], bestp);
+}
+
+/* produce the new rpn for the tree, freeing tokens as they're
+ * replaced by temporaries */
+token **
+exprnode_emit(exprnode *n, token **tail)
+{
+	token *t;
+	int i;
+
+	if (n->slot < 0) {
+		t = (token *)scratch_alloc(sizeof(token));
+		t->type = TEMPLOAD;
+		t->slot = cse_base - n->slot - 1;
+		t->alloced = 1;
+		*tail = t;
+		return &t->next;
+	}
+
+	for (i = 0; i < n->nkids; i++)
+		tail = exprnode_emit(n->kid[i], tail);
+
+	*tail = n->tok;
+	tail = &n->tok->next;
+
+	if (n->slot > 0) {
+		t = (token *)scratch_alloc(sizeof(token));
+		t->type = TEMPSTORE;
+		t->slot = cse_base + n->slot - 1;
+		t->alloced = 1;
+		*tail = t;
+		tail = &t->next;
+	}
+	return tail;
+}
+
+void
+exprnode_free_loaded(exprnode *n, boolean dead)
+{
+	int i;
+
+	if (n->slot < 0)
+		dead = TRUE;
+
+	for (i = 0; i < n->nkids; i++)
+		exprnode_free_loaded(n->kid[i], dead);
+
+	if (dead)
+		tfree(n->tok);
+}
+
+void
+common_subexpressions(token **queuep)
+{
+	exprnode *nodes, **sim, *root, *best;
+	token *t, *rest, **tail;
+	int ntok = 0, depth = 0, nslots = 0, i, n;
+	opreturn assignment(void);
+	opreturn call_function(void);
+
+	for (t = *queuep; t && t->type != EOL; t = t->next)
+		ntok++;
+
+	if (ntok < 3)
+		return;
+
+	nodes = (exprnode *)safe_calloc((size_t)ntok * sizeof(exprnode));
+	sim = (exprnode **)safe_calloc((size_t)ntok * sizeof(exprnode *));
+
+	/* build the tree, giving up on anything that isn't pure */
+	for (i = 0, t = *queuep; i < ntok; i++, t = t->next) {
+		exprnode *e = &nodes[i];
+
+		e->tok = t;
+		e->order = i;
+		e->size = 1;
+
+		switch (t->type) {
+		case NUMERIC:
+		case VARIABLE:
+			break;
+		case SYMBOLIC:
+		case OP:
+			n = (t->type == OP) ? t->oper->operands : 0;
+			if ((t->type == OP && n < 1) || n > 2 || depth < n ||
+				t->oper->func == assignment ||
+				t->oper->func == semicolon ||
+				t->oper->func == call_function)
+				goto out;
+			e->nkids = n;
+			while (n--) {
+				e->kid[n] = sim[--depth];
+				e->size += e->kid[n]->size;
+			}
+			break;
+		default:
+			goto out;
+		}
+		exprnode_key(e);
+		sim[depth++] = e;
+	}
+	if (depth != 1)
+		goto out;
+
+	root = sim[0];
+	rest = t;	// EOL, if any
+
+	while (1) {
+		best = NULL;
+		exprnode_biggest_repeat(root, root, &best);
+		if (!best)
+			break;
+
+		exprnode *first = NULL;
+		exprnode_matches(root, best->key, &first);
+		trace(SHUNT, " common subexpression: %s\n", best->key);
+		nslots++;
+		exprnode_mark(root, best->key, nslots);
+		first->slot = nslots;
+	}
+
+	if (!nslots)
+		goto out;
+
+	while (cse_ntemps < cse_base + nslots) {
+		cse_temps = (mpd_t **)realloc(cse_temps,
+				(size_t)(cse_ntemps + 1) * sizeof(mpd_t *));
+		if (!cse_temps) {
+			perror("rca: realloc failed");
+			exit(3);
+		}
+		cse_temps[cse_ntemps] = mpd_new(ctx);
+		mpd_copy(cse_temps[cse_ntemps], zero, ctx);
+		cse_ntemps++;
+	}
+
+	tail = exprnode_emit(root, queuep);
+	*tail = rest;
+	exprnode_free_loaded(root, FALSE);
+
+    out:
+	for (i = 0; i < ntok; i++)
+		free(nodes[i].key);
+	free(nodes);
+	free(sim);
+}
+
+// ------------------------    variables
+
+opreturn
+assignment(void)
+{
+	/* This gets decremented with every RPN token executed.  If a
+	 * variable is the very next token, we'll write to it instead
+	 * of read.  */
+	variable_write_enable = 2;
+	trace(EXEC,( " enabling assignment\n"));
+	return GOODOP;
+}
+
+typedef struct {
+    mpd_t *mpd;
+    char *name;
+} dynvar;
+
+#define NVAR 50
+dynvar variables[NVAR];
+
+int
+comparevars(const void *a, const void *b)
+{
+	dynvar *va = (dynvar *)a;
+	dynvar *vb = (dynvar *)b;
+
+	return strcmp(va->name, vb->name);
+}
+
+opreturn
+clearvars(void)
+{
+	void functions_forget_vars(void);
+	dynvar *v;
+
+	for (v = variables; v->name; v++) {
+		mpd_del(v->mpd);
+		v->mpd = 0;
+		free(v->name);
+		v->name = 0;
+	}
+	functions_forget_vars();
+	return GOODOP;
+}
+
+opreturn
+showvars(void)
+{
+	void functions_forget_vars(void);
+	dynvar *v;
+
+	if (!variables->name) {
+		if (json_output)
+			puts("{}");
+		else
+			p_printf(" <none>\n");
+		return GOODOP;
+	}
+	for (v = variables; v->name; v++)
+		/* count the variables */;
+
+	qsort(variables, (size_t)(v - variables), sizeof(*v), comparevars);
+	functions_forget_vars();
+
+	if (json_output || csv_output) {
+		if (json_output)
+			putchar('{');
+		for (v = variables; v->name; v++) {
+			if (json_output)
+				printf("%s\"%s\": ", v == variables ? "" : ", ",
+					v->name);
+			else
+				printf("%s,", v->name);
+			put_value(v->mpd, mode);
+			if (!json_output)
+				putchar('\n');
+		}
+		if (json_output)
+			puts("}");
+		return GOODOP;
+	}
+
+	int savealign = rightalignment;
+	rightalignment = 0;
+	for (v = variables; v->name; v++) {
+		p_printf(" %20s ", v->name);
+		print_n(v->mpd, mode, 0, 0);
+	}
+	rightalignment = savealign;
+
+	return GOODOP;
+}
+
+dynvar *
+findvar(char *name)
+{
+	dynvar *v;
+	for (v = variables; v->name && v < variables + NVAR-1; v++) {
+		if (strcmp(name, v->name) == 0) {
+			return v;
+		}
+	}
+	if (v < variables + NVAR-1) {
+		v->name = strdup(name);
+		v->mpd = mpd_new(ctx);
+		mpd_set_i64(v->mpd, 0, ctx);
+		return v;
+	}
+	return 0;
+}
+
+int
+variable_access(dynvar *v)
+{
+	if (!v) {
+		error(" error: out of space for variables\n");
+		return 0;
+	}
+
+	/* if we were preceded by '=', set our value */
+	if (variable_write_enable) {
+		mpd_t *x;
+		if (!mpeek(&x)) {
+			trace(EXEC, " nothing to assign\n");
+			return 0;
+		}
+		// trace(EXEC, " assigning %Lg to %s\n", a, v->name);
+		if (!v->mpd)
+			v->mpd  = mpd_new(ctx);
+		mpd_copy(v->mpd, x, ctx);
+	} else {
+		mpush_copy(v->mpd);
+	}
+	return 1;
+}
+
+int
+dynamic_var(token *t)
+{
+	return variable_access(findvar(t->valstr));
+}
+
+// ------------------------    compiled infix programs
+
+/* Once the shunting yard has produced (and optimized) the rpn for
+ * an infix expression, it's turned into an array of instructions,
+ * with variables already looked up and each one's action chosen
+ * ahead of time.  main() then runs the whole thing at once, rather
+ * than popping, copying, and dispatching one token at a time.  The
+ * array is reused from one expression to the next.  */
+
+typedef struct insn {
+	void (*exec)(struct insn *);
+	mpd_t *mpd;	/* NUMERIC:  the value, pushed without copying */
+	oper *oper;	/* OP, SYMBOLIC */
+	dynvar *var;	/* VARIABLE */
+	char *name;	/* VARIABLE:  kept for tracing */
+	char *str;	/* UNKNOWN:  kept for the error message */
+	int slot;	/* TEMPSTORE, TEMPLOAD */
+	char type;	/* these two are what autoprint needs */
+	char imode;
+} insn;
+
+typedef struct code {
+	insn *insns;
+	int len, size;
+} code;
+
+code program;		/* the expression being run now */
+code *compiling = &program;
+
+void
+exec_numeric(insn *ip)
+{
+	trace_mpd(EXEC, "numeric", ip->mpd);
+	mpush(ip->mpd);
+	ip->mpd = NULL;
+}
+
+/* like exec_numeric(), for code that's run more than once */
+void
+exec_constant(insn *ip)
+{
+	trace_mpd(EXEC, "constant", ip->mpd);
+	mpush_copy(ip->mpd);
+}
+
+void
+exec_variable(insn *ip)
+{
+	trace(EXEC, " variable %s\n", ip->name);
+	if (!ip->var)	// a function's, after the variables moved
+		ip->var = findvar(ip->name);
+	variable_access(ip->var);
+}
+
+void
+exec_oper(insn *ip)
+{
+	opreturn quit(void);
+
+	trace(EXEC, " invoking %s\n", ip->oper->name);
+	if (ip->oper->func == quit)
+		pending_show();
+	invoked_oper = ip->oper;
+	(ip->oper->func) ();
+}
+
+void
+exec_tempstore(insn *ip)
+{
+	temp_store(ip->slot);
+}
+
+void
+exec_tempload(insn *ip)
+{
+	temp_load(ip->slot);
+}
+
+void
+exec_unknown(insn *ip)
+{
+	error(" error:  unrecognized input '%s'\n", ip->str);
+}
+
+/* turn everything on the queue up to the EOL into instructions,
+ * appended to the code being compiled.  the EOL, if there is one, is
+ * left for main() to handle.  */
+void
+compile_program(token **queuep)
+{
+	code *c = compiling;
+	token *t;
+	insn *ip;
+
+	while ((t = *queuep) && t->type != EOL) {
+		*queuep = t->next;
+
+		if (c->len == c->size) {
+			c->size = c->size ? 2 * c->size : 32;
+			c->insns = (insn *)realloc(c->insns,
+				(size_t)c->size * sizeof(insn));
+			if (!c->insns) {
+				perror("rca: realloc failed");
+				exit(3);
+			}
+		}
+		ip = &c->insns[c->len++];
+		memset(ip, 0, sizeof(*ip));
+		ip->type = (char)t->type;
+		ip->imode = (char)t->imode;
+
+		switch (t->type) {
+		case NUMERIC:
+			ip->exec = (c == &program) ? exec_numeric : exec_constant;
+			ip->mpd = t->mpd;
+			t->mpd = NULL;
+			break;
+		case VARIABLE:
+			ip->exec = exec_variable;
+			ip->var = findvar(t->valstr);
+			ip->name = (c == &program) ? t->valstr :
+						strdup(t->valstr);
+			break;
+		case SYMBOLIC:
+		case OP:
+			ip->exec = exec_oper;
+			ip->oper = t->oper;
+			break;
+		case TEMPSTORE:
+			ip->exec = exec_tempstore;
+			ip->slot = t->slot;
+			break;
+		case TEMPLOAD:
+			ip->exec = exec_tempload;
+			ip->slot = t->slot;
+			break;
+		default:
+			ip->exec = exec_unknown;
+			ip->str = t->str;
+			break;
+		}
+		tfree(t);
+	}
+}
+
+/* run the compiled program.  the semantics are those of the token
+ * loop in main():  lastx is frozen, pending output is only kept from
+ * the last instruction, and '=' only reaches the instruction after
+ * it.  *pt is left describing the final instruction, for autoprint.  */
+void
+run_program(token *pt)
+{
+	insn *ip, *end = program.insns + program.len;
+
+	freeze_lastx();
+	valgrind("pre program");
+
+	for (ip = program.insns; ip < end; ip++) {
+		pending_clear();
+		(ip->exec)(ip);
+		if (variable_write_enable)
+			variable_write_enable--;
+	}
+
+	valgrind("post program");
+
+	ip = end - 1;
+	pt->type = ip->type;
+	pt->imode = ip->imode;
+	pt->oper = ip->oper;
+	pt->valstr = NULL;
+
+	program.len = 0;
+}
+
+// ------------------------    user defined functions
+
+/* "define hyp _a _b (sqrt(_a*_a + _b*_b))" compiles the expression
+ * once, and makes "hyp" an operator like any other, in rpn or infix.
+ * when it runs, its operands are popped into the parameters (the
+ * last one gets x), the body is run, and the parameters get their
+ * old values back.  the body can also be rpn, following a ':', as in
+ * "define hyp _a _b : _a _a * _b _b * + sqrt".  */
+
+#define MAX_PARAMS 8
+#define MAX_CALL_DEPTH 100
+
+typedef struct ufunc {
+	oper op;	/* must be first:  invoked_oper points here */
+	int nparams;
+	char *params[MAX_PARAMS];
+	dynvar *pvars[MAX_PARAMS];
+	char *text;	/* the rest of the definition, for "functions" */
+	code body;
+	int ntemps;	/* unnamed ones:  temporaries in use before them */
+	struct ufunc *next;
+} ufunc;
+
+ufunc *functions;
+int call_depth;
+boolean call_failed;	/* a nested call failed:  unwind to the top */
+
+oper *
+find_function(char *name, size_t len)
+{
+	ufunc *f;
+
+	for (f = functions; f; f = f->next)
+		if (strlen(f->op.name) == len &&
+				!strncmp(f->op.name, name, len))
+			return &f->op;
+	return NULL;
+}
+
+void
+code_free(code *c)
+{
+	insn *ip;
+
+	for (ip = c->insns; ip < c->insns + c->len; ip++) {
+		if (ip->mpd)
+			mpd_del(ip->mpd);
+		free(ip->name);
+	}
+	free(c->insns);
+	memset(c, 0, sizeof(*c));
+}
+
+/* the variables array gets sorted and cleared, so functions have to
+ * look their variables up again, by name, the next time they run */
+void
+functions_forget_vars(void)
+{
+	ufunc *f;
+	insn *ip;
+	int i;
+
+	for (f = functions; f; f = f->next) {
+		for (i = 0; i < f->nparams; i++)
+			f->pvars[i] = NULL;
+		for (ip = f->body.insns; ip < f->body.insns + f->body.len; ip++)
+			if (ip->name)
+				ip->var = NULL;
+	}
+}
+
+opreturn
+call_function(void)
+{
+	ufunc *f = (ufunc *)invoked_oper;
+	mpd_t *args[MAX_PARAMS], *saved[MAX_PARAMS], *m;
+	insn *ip, *end = f->body.insns + f->body.len;
+	int i, n = f->nparams, base;
+
+	if (stack_count < n) {
+		error(" error: %s needs %d operand%s\n", f->op.name, n,
+			n == 1 ? "" : "s");
+		goto fail;
+	}
+	if (call_depth >= MAX_CALL_DEPTH) {
+		error(" error: functions nested too deeply\n");
+		goto fail;
+	}
+	for (i = 0; i < n; i++) {
+		if (!f->pvars[i] && !(f->pvars[i] = findvar(f->params[i]))) {
+			error(" error: out of space for variables\n");
+			goto fail;
+		}
+	}
+
+	for (i = n; i-- > 0; )
+		mpop(&args[i]);
+	for (i = 0; i < n; i++) {
+		saved[i] = f->pvars[i]->mpd;
+		f->pvars[i]->mpd = args[i];
+	}
+	base = stack_count;
+
+	call_depth++;
+	for (ip = f->body.insns; ip < end && !call_failed; ip++) {
+		(ip->exec)(ip);
+		if (variable_write_enable)
+			variable_write_enable--;
+	}
+	call_depth--;
+
+	/* the rest of the body was skipped.  drop what it left, and
+	 * give the operands back, as a builtin would.  */
+	if (call_failed) {
+		while (stack_count > base && mpop(&m))
+			mpd_del(m);
+		for (i = 0; i < n; i++) {
+			mpush(f->pvars[i]->mpd);
+			f->pvars[i]->mpd = saved[i];
+		}
+		if (call_depth == 0)
+			call_failed = 0;
+		return BADOP;
+	}
+
+	// as with the builtin operators, lastx is x (and lasty is y)
+	if (n > 0)
+		set_lastx(f->pvars[n - 1]->mpd);
+	if (n > 1)
+		set_lasty(f->pvars[n - 2]->mpd);
+
+	for (i = 0; i < n; i++) {
+		mpd_del(f->pvars[i]->mpd);
+		f->pvars[i]->mpd = saved[i];
+	}
+	return GOODOP;
+
+    fail:
+	if (call_depth > 0)
+		call_failed = 1;
+	return BADOP;
+}
+
+/* compile the body of a function:  either a parenthesized infix
+ * expression, or rpn to the end of the line.  returns the text of
+ * the body's end, or NULL if it failed.  */
+char *
+compile_body(token *tok)
+{
+	opreturn open_paren(void);
+	opreturn solve(void);
+	opreturn integrate(void);
+	char *end;
+	token *q;
+
+	if (tok->oper->func == open_paren)
+		return (shunting_yard(1) == GOODOP) ? input_ptr : NULL;
+
+	while (1) {
+		end = input_ptr;
+		if (!read_token(tok, RPN))
+			return NULL;
+		if (tok->type == EOL) {
+			putback_token(tok);  // the line still needs to end
+			return end;
+		}
+		if (tok->type == OP && tok->oper->func == open_paren) {
+			if (shunting_yard(1) != GOODOP)
+				return NULL;
+			continue;
+		}
+		if (tok->type == OP && (tok->oper->operands == 0 ||
+				tok->oper->func == solve ||
+				tok->oper->func == integrate)) {
+			error(" error: '%s' can't be used in a function\n",
+				tok->oper->name);
+			input_ptr = NULL;
+			return NULL;
+		}
+		q = NULL;
+		tpush(&q, tok);
+		compile_program(&q);
+		tfree(tok);
+	}
+}
+
+/* read a function's parameters, and then its body, from the input.
+ * on success they're in *f, along with the text of the definition. */
+boolean
+parse_function(ufunc *f)
+{
+	opreturn open_paren(void);
+	char *defn = input_ptr, *end;
+	char *params[MAX_PARAMS];
+	int nparams = 0, i;
+	code body = {0};
+	token tok;
+
+	// the parameters, and then '(' or ':' to start the body
+	while (1) {
+		if (!read_token(&tok, RPN))
+			goto fail;
+		if (tok.type == OP && (tok.oper->func == open_paren ||
+				tok.oper->func == rpnswitch))
+			break;
+		if (tok.type != VARIABLE) {
+			error(" error: expected a parameter, '(', or ':'\n");
+			tfree(&tok);
+			input_ptr = NULL;
+			goto fail;
+		}
+		for (i = 0; i < nparams; i++)
+			if (!strcmp(params[i], tok.valstr))
+				break;
+		if (i < nparams || nparams == MAX_PARAMS) {
+			error(" error: %s parameter '%s'\n",
+				i < nparams ? "repeated" : "one too many",
+				tok.valstr);
+			tfree(&tok);
+			input_ptr = NULL;
+			goto fail;
+		}
+		params[nparams++] = strdup(tok.valstr);
+	}
+
+	// the body gets temporaries of its own
+	compiling = &body;
+	cse_base = cse_ntemps;
+	end = compile_body(&tok);
+	compiling = &program;
+	cse_base = cse_ntemps;
+	if (!end)
+		goto fail;
+	if (!body.len) {
+		error(" error: empty function\n");
+		goto fail;
+	}
+
+	f->nparams = nparams;
+	for (i = 0; i < nparams; i++) {
+		f->params[i] = params[i];
+		f->pvars[i] = NULL;
+	}
+	while (isspace(*defn))
+		defn++;
+	while (end > defn && isspace(end[-1]))
+		end--;
+	f->text = strndup(defn, (size_t)(end - defn));
+	f->body = body;
+	return TRUE;
+
+    fail:
+	code_free(&body);
+	for (i = 0; i < nparams; i++)
+		free(params[i]);
+	return FALSE;
+}
+
+/* everything but the name */
+void
+function_free(ufunc *f)
+{
+	int i;
+
+	code_free(&f->body);
+	for (i = 0; i < f->nparams; i++)
+		free(f->params[i]);
+	f->nparams = 0;
+	free(f->text);
+	f->text = NULL;
+}
+
+opreturn
+define(void)
+{
+	size_t stralnum(char *s, char **endptr);
+	char *p = input_ptr, *np;
+	ufunc nf = {0}, *f;
+	oper *op;
+	size_t n;
+
+	while (p && isspace(*p))
+		p++;
+	if (!p || !isalpha(*p)) {
+		error(" error: usage:  define name [_param ...] ( expression )\n");
+		input_ptr = NULL;
+		return BADOP;
+	}
+	n = stralnum(p, &np);
+	for (op = opers; op->name; op++) {
+		if (op->func && strlen(op->name) == n &&
+				!strncmp(op->name, p, n)) {
+			error(" error: '%s' is already a command\n", op->name);
+			input_ptr = NULL;
+			return BADOP;
+		}
+	}
+	input_ptr = np;
+
+	if (!parse_function(&nf))
+		return BADOP;
+
+	if ((op = find_function(p, n))) {	// a redefinition
+		f = (ufunc *)op;
+		function_free(f);
+	} else {
+		ufunc **fp = &functions;
+		while (*fp)
+			fp = &(*fp)->next;
+		*fp = f = (ufunc *)safe_calloc(sizeof(ufunc));
+		f->op.name = strndup(p, n);
+		f->op.func = call_function;
+	}
+
+	/* how it fits in infix:  no parameters is like "pi", one is
+	 * like "sqrt", and two is like "mod".  more aren't allowed.  */
+	f->op.operands = nf.nparams == 0 ? Sym :
+				nf.nparams > 2 ? Auto : nf.nparams;
+	f->op.prec = (nf.nparams == 1) ? 30 : 26;
+	f->op.assoc = (nf.nparams == 1) ? 'R' : 0;
+
+	memcpy(f->params, nf.params, sizeof(f->params));
+	memcpy(f->pvars, nf.pvars, sizeof(f->pvars));
+	f->nparams = nf.nparams;
+	f->text = nf.text;
+	f->body = nf.body;
+
+	p_printf(" Defined %s, with %d parameter%s\n", f->op.name,
+		f->nparams, f->nparams == 1 ? "" : "s");
+	return GOODOP;
+}
+
+opreturn
+showfunctions(void)
+{
+	ufunc *f;
+
+	if (!functions) {
+		p_printf(" <none>\n");
+		return GOODOP;
+	}
+	for (f = functions; f; f = f->next)
+		p_printf(" %s %s\n", f->op.name, f->text);
+	return GOODOP;
+}
+
+// ------------------------    solving and integrating
+
+/* "solve" and "integrate" work on a function of one parameter, over
+ * the interval from y to x.  the function is named right after the
+ * command, or is written there as it would be for define:
+ *	0 1 solve _t (cos(_t) - _t)
+ * either way, it's compiled just once, and then run as often as
+ * needed.  */
+
+/* free an unnamed function, and give back its temporaries */
+void
+function_done(ufunc *f)
+{
+	function_free(f);
+	while (cse_ntemps > f->ntemps)
+		mpd_del(cse_temps[--cse_ntemps]);
+	cse_base = cse_ntemps;
+}
+
+/* get the function following "who".  an unnamed one is built in
+ * *anon, and has to be freed with function_done().  */
+ufunc *
+function_operand(ufunc *anon, char *who)
+{
+	size_t stralnum(char *s, char **endptr);
+	char *p = input_ptr, *np;
+	ufunc *f;
+	size_t n;
+
+	while (p && isspace(*p))
+		p++;
+	if (p && *p == '_') {
+		memset(anon, 0, sizeof(*anon));
+		anon->op.name = "function";
+		anon->op.func = call_function;
+		anon->ntemps = cse_ntemps;
+		if (!parse_function(anon)) {
+			function_done(anon);
+			return NULL;
+		}
+		f = anon;
+	} else if (p && isalpha(*p)) {
+		n = stralnum(p, &np);
+		input_ptr = np;
+		if (!(f = (ufunc *)find_function(p, n))) {
+			error(" error: no function named '%.*s'\n", (int)n, p);
+			input_ptr = NULL;
+			return NULL;
+		}
+	} else {
+		error(" error: usage:  %s { name | _param ( expression ) }\n",
+			who);
+		input_ptr = NULL;
+		return NULL;
+	}
+	if (f->nparams != 1) {
+		error(" error: %s needs a function of one parameter\n", who);
+		if (f == anon)
+			function_done(anon);
+		input_ptr = NULL;
+		return NULL;
+	}
+	return f;
+}
+
+/* r = f(x).  fails if f does, or if it doesn't leave one result. */
+boolean
+eval_function(ufunc *f, const mpd_t *x, mpd_t *r)
+{
+	int depth = stack_count;
+	mpd_t *v;
+
+	mpush_copy(x);
+	invoked_oper = &f->op;
+	if (call_function() != GOODOP || stack_count != depth + 1) {
+		if (stack_count != depth + 1)
+			error(" error: %s didn't leave one result\n",
+				f->op.name);
+		while (stack_count > depth && mpop(&v))
+			mpd_del(v);
+		return FALSE;
+	}
+	mpop(&v);
+	if (!mpd_isfinite(v)) {
+		error(" error: %s result isn't finite\n", f->op.name);
+		mpd_del(v);
+		return FALSE;
+	}
+	mpd_copy(r, v, ctx);
+	mpd_del(v);
+	return TRUE;
+}
+
+int
+sign_of(const mpd_t *m)
+{
+	return mpd_iszero(m) ? 0 : mpd_isnegative(m) ? -1 : 1;
+}
+
+#define SOLVE_ROUGH 20		/* digits, for the first pass */
+#define SOLVE_ITERS 1000
+
+/* "lo hi solve f" finds the x in [lo, hi] for which f(x) is 0, using
+ * brent's method:  inverse quadratic interpolation or the secant
+ * method while they make good progress, and bisection when they
+ * don't.  the root stays bracketed by b and c the whole time.  the
+ * first pass works at low precision, and only the last few steps
+ * are done at full precision.  */
+opreturn
+solve(void)
+{
+	ufunc anon, *f;
+	mpd_t *x, *y, *r;
+	mpd_t *a, *b, *c, *fa, *fb, *fc, *flo, *fhi;
+	mpd_t *d, *e, *eps, *tiny, *tol, *xm, *s, *p, *q, *t, *u;
+	mpd_ssize_t prec = ctx->prec;
+	opreturn ret = BADOP;
+	int pass, i;
+
+	if (!(f = function_operand(&anon, "solve")))
+		return BADOP;
+
+	if (!floating_mode(mode)) {
+		error(" error: solve makes no sense in integer mode\n");
+		goto out;
+	}
+	if (!mpop(&x))
+		goto out;
+	if (!mpop(&y)) {
+		mpush(x);
+		goto out;
+	}
+
+	a = mpd_new(ctx); b = mpd_new(ctx); c = mpd_new(ctx);
+	fa = mpd_new(ctx); fb = mpd_new(ctx); fc = mpd_new(ctx);
+	flo = mpd_new(ctx); fhi = mpd_new(ctx);
+	d = mpd_new(ctx); e = mpd_new(ctx); eps = mpd_new(ctx);
+	tiny = mpd_new(ctx); tol = mpd_new(ctx); xm = mpd_new(ctx);
+	s = mpd_new(ctx); p = mpd_new(ctx); q = mpd_new(ctx);
+	t = mpd_new(ctx); u = mpd_new(ctx);
+
+	// the ends are checked at full precision
+	if (!eval_function(f, y, flo) || !eval_function(f, x, fhi))
+		goto fail;
+	if (sign_of(flo) * sign_of(fhi) > 0) {
+		error(" error: %s doesn't change sign between y and x\n",
+			f->op.name);
+		goto fail;
+	}
+	mpd_copy(a, y, ctx);
+	mpd_copy(fa, flo, ctx);
+	mpd_copy(b, x, ctx);
+	mpd_copy(fb, fhi, ctx);
+
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 0) {
+			ctx->prec = (prec < SOLVE_ROUGH) ? prec : SOLVE_ROUGH;
+			mpd_set_i32(eps, 1, ctx);
+			eps->exp = -(ctx->prec - 4);
+		} else {
+			/* the rough bracket is good unless rounding
+			 * made it look like one.  */
+			ctx->prec = prec;
+			mpd_set_i32(eps, 1, ctx);
+			eps->exp = -(max_digits + 2);
+			mpd_copy(a, c, ctx);
+			if (!eval_function(f, a, fa) ||
+					!eval_function(f, b, fb))
+				goto fail;
+			if (sign_of(fa) * sign_of(fb) > 0) {
+				mpd_copy(a, y, ctx);
+				mpd_copy(fa, flo, ctx);
+				mpd_copy(b, x, ctx);
+				mpd_copy(fb, fhi, ctx);
+			}
+		}
+		mpd_mul(tiny, eps, eps, ctx);
+
+		mpd_copy(c, a, ctx);
+		mpd_copy(fc, fa, ctx);
+		mpd_sub(d, b, a, ctx);
+		mpd_copy(e, d, ctx);
+
+		for (i = 0; ; i++) {
+			if (sign_of(fb) == sign_of(fc)) {
+				mpd_copy(c, a, ctx);
+				mpd_copy(fc, fa, ctx);
+				mpd_sub(d, b, a, ctx);
+				mpd_copy(e, d, ctx);
+			}
+			if (mpd_cmp_total_mag(fc, fb) < 0) {  // b is best
+				mpd_copy(a, b, ctx);
+				mpd_copy(fa, fb, ctx);
+				r = b; b = c; c = r;
+				r = fb; fb = fc; fc = r;
+			}
+
+			// tol = eps * |b| + eps^2,  xm = (c - b) / 2
+			mpd_mul(tol, eps, b, ctx);
+			mpd_abs(tol, tol, ctx);
+			mpd_add(tol, tol, tiny, ctx);
+			mpd_sub(xm, c, b, ctx);
+			mpd_div(xm, xm, two, ctx);
+			if (mpd_cmp_total_mag(xm, tol) <= 0 || mpd_iszero(fb))
+				break;
+
+			if (i == SOLVE_ITERS) {
+				error(" error: solve didn't converge\n");
+				goto fail;
+			}
+
+			if (mpd_cmp_total_mag(e, tol) >= 0 &&
+					mpd_cmp_total_mag(fa, fb) > 0) {
+				mpd_div(s, fb, fa, ctx);
+				if (mpd_cmp(a, c, ctx) == 0) {
+					// secant:  p = 2 xm s,  q = 1 - s
+					mpd_mul(p, xm, s, ctx);
+					mpd_mul(p, p, two, ctx);
+					mpd_sub(q, one, s, ctx);
+				} else {
+					/* inverse quadratic, with
+					 * q = fa/fc and t = fb/fc - 1:
+					 *  p = s (2 xm q (q - t - 1) - (b - a) t)
+					 *  q = (q - 1) t (s - 1)  */
+					mpd_div(q, fa, fc, ctx);
+					mpd_div(t, fb, fc, ctx);
+					mpd_sub(t, t, one, ctx);
+					mpd_sub(p, q, t, ctx);
+					mpd_sub(p, p, one, ctx);
+					mpd_mul(p, p, q, ctx);
+					mpd_mul(p, p, xm, ctx);
+					mpd_mul(p, p, two, ctx);
+					mpd_sub(u, b, a, ctx);
+					mpd_mul(u, u, t, ctx);
+					mpd_sub(p, p, u, ctx);
+					mpd_mul(p, p, s, ctx);
+					mpd_sub(q, q, one, ctx);
+					mpd_mul(q, q, t, ctx);
+					mpd_sub(u, s, one, ctx);
+					mpd_mul(q, q, u, ctx);
+				}
+				if (mpd_ispositive(p))
+					mpd_minus(q, q, ctx);
+				mpd_abs(p, p, ctx);
+
+				/* take the step if it stays well inside
+				 * the bracket, and is smaller than the
+				 * one before last:  2p < 3 xm q - |tol q|
+				 * and 2p < |e q| */
+				mpd_mul(u, xm, q, ctx);
+				mpd_mul_i64(u, u, 3, ctx);
+				mpd_mul(t, tol, q, ctx);
+				mpd_abs(t, t, ctx);
+				mpd_sub(u, u, t, ctx);
+				mpd_mul(t, e, q, ctx);
+				mpd_abs(t, t, ctx);
+				mpd_mul(s, p, two, ctx);
+				if (mpd_cmp(s, u, ctx) < 0 &&
+						mpd_cmp(s, t, ctx) < 0) {
+					mpd_copy(e, d, ctx);
+					mpd_div(d, p, q, ctx);
+				} else {
+					mpd_copy(d, xm, ctx);
+					mpd_copy(e, d, ctx);
+				}
+			} else {	// bisect
+				mpd_copy(d, xm, ctx);
+				mpd_copy(e, d, ctx);
+			}
+
+			mpd_copy(a, b, ctx);
+			mpd_copy(fa, fb, ctx);
+			if (mpd_cmp_total_mag(d, tol) > 0)
+				mpd_add(b, b, d, ctx);
+			else if (mpd_ispositive(xm))
+				mpd_add(b, b, tol, ctx);
+			else
+				mpd_sub(b, b, tol, ctx);
+			if (!eval_function(f, b, fb))
+				goto fail;
+		}
+		trace(EXEC, "solve pass %d: %d iterations\n", pass, i);
+	}
+
+	r = move_lastx(x);
+	mpd_del(move_lasty(y));
+	mpd_copy(r, b, ctx);
+	mpush(r);
+	ret = GOODOP;
+
+    fail:
+	ctx->prec = prec;
+	if (ret != GOODOP) {
+		mpush(y);
+		mpush(x);
+	}
+	mpd_del(a); mpd_del(b); mpd_del(c);
+	mpd_del(fa); mpd_del(fb); mpd_del(fc);
+	mpd_del(flo); mpd_del(fhi);
+	mpd_del(d); mpd_del(e); mpd_del(eps);
+	mpd_del(tiny); mpd_del(tol); mpd_del(xm);
+	mpd_del(s); mpd_del(p); mpd_del(q);
+	mpd_del(t); mpd_del(u);
+    out:
+	if (f == &anon)
+		function_done(&anon);
+	return ret;
+}
+
+/* "lo hi integrate f" uses tanh-sinh quadrature.  the substitution
+ * x = tanh(pi/2 sinh(t)) crowds the points toward the ends of the
+ * interval, where their weights fall off double exponentially, so
+ * the trapezoid rule in t converges very quickly, even with a
+ * singularity at an end.  each level halves the step in t, adding
+ * only the points in between the old ones.  the points and weights
+ * don't depend on f or the interval, so they're kept, for as long
+ * as the precision stays the same.  */
+
+#define TS_LEVELS 10
+
+struct ts_level {
+	int n;		/* how many points */
+	mpd_t **node;	/* pairs:  1 - tanh(pi/2 sinh(t)), and the weight */
+};
+
+struct {
+	mpd_ssize_t prec;
+	int levels;	/* how many are filled in */
+	struct ts_level level[TS_LEVELS];
+} ts_cache;
+
+/* the points for level L are t = k / 2^L, for k = 0, 1, 2... at level
+ * 0, and for odd k after that.  they run out when they're too close
+ * to the ends of the interval to matter, even for a function that's
+ * infinite there.  */
+void
+ts_fill(int L)
+{
+	struct ts_level *lv = &ts_cache.level[L];
+	mpd_t *t, *h, *et, *eq, *ch, *q, *v, *w;
+	int k, size = 0;
+
+	t = mpd_new(ctx); h = mpd_new(ctx);
+	et = mpd_new(ctx); eq = mpd_new(ctx);
+	ch = mpd_new(ctx); q = mpd_new(ctx);
+
+	mpd_set_u64(h, (uint64_t)1 << L, ctx);
+	for (k = L ? 1 : 0; ; k += L ? 2 : 1) {
+		mpd_set_i32(t, k, ctx);
+		mpd_div(t, t, h, ctx);
+
+		// q = pi/2 sinh(t),  ch = cosh(t)
+		mpd_exp(et, t, ctx);
+		mpd_div(q, one, et, ctx);
+		mpd_add(ch, et, q, ctx);
+		mpd_div(ch, ch, two, ctx);
+		mpd_sub(q, et, q, ctx);
+		mpd_div(q, q, two, ctx);
+		mpd_mul(q, q, pi_over_2, ctx);
+
+		// v = 1 - tanh(q) = 2 / (1 + e^2q)
+		mpd_exp(eq, q, ctx);
+		v = mpd_new(ctx);
+		mpd_mul(v, eq, eq, ctx);
+		mpd_add(v, v, one, ctx);
+		mpd_div(v, two, v, ctx);
+		if (mpd_iszero(v) || mpd_adjexp(v) < -2 * ctx->prec) {
+			mpd_del(v);
+			break;
+		}
+
+		// w = pi/2 cosh(t) / cosh(q)^2
+		w = mpd_new(ctx);
+		mpd_div(q, one, eq, ctx);
+		mpd_add(q, eq, q, ctx);
+		mpd_div(q, q, two, ctx);
+		mpd_mul(q, q, q, ctx);
+		mpd_mul(w, pi_over_2, ch, ctx);
+		mpd_div(w, w, q, ctx);
+
+		if (lv->n == size) {
+			size = size ? size * 2 : 16;
+			lv->node = (mpd_t **)realloc(lv->node,
+					(size_t)size * 2 * sizeof(mpd_t *));
+			if (!lv->node) {
+				perror("rca: realloc failed");
+				exit(3);
+			}
+		}
+		lv->node[2 * lv->n] = v;
+		lv->node[2 * lv->n + 1] = w;
+		lv->n++;
+	}
+
+	mpd_del(t); mpd_del(h);
+	mpd_del(et); mpd_del(eq);
+	mpd_del(ch); mpd_del(q);
+}
+
+struct ts_level *
+ts_nodes(int L)
+{
+	int i;
+
+	if (ts_cache.prec != ctx->prec) {	// start over
+		while (ts_cache.levels > 0) {
+			struct ts_level *lv =
+				&ts_cache.level[--ts_cache.levels];
+			for (i = 0; i < 2 * lv->n; i++)
+				mpd_del(lv->node[i]);
+			free(lv->node);
+			lv->node = NULL;
+			lv->n = 0;
+		}
+		ts_cache.prec = ctx->prec;
+	}
+	while (ts_cache.levels <= L)
+		ts_fill(ts_cache.levels++);
+	return &ts_cache.level[L];
+}
+
+/* the log10 of |m| relative to |scale|, roughly */
+long
+rel_exponent(const mpd_t *m, const mpd_t *scale)
+{
+	return (long)(mpd_adjexp(m) - mpd_adjexp(scale));
+}
+
+opreturn
+integrate(void)
+{
+	ufunc anon, *f;
+	struct ts_level *lv;
+	mpd_t *x, *y, *r;
+	mpd_t *hh, *dx, *pt, *fx, *sum, *abssum, *s, *prev, *prev2;
+	mpd_t *scale, *diff;
+	opreturn ret = BADOP;
+	long d1, d2, est, want = -(max_digits + 1);
+	int L, i, side;
+
+	if (!(f = function_operand(&anon, "integrate")))
+		return BADOP;
+
+	if (!floating_mode(mode)) {
+		error(" error: integrate makes no sense in integer mode\n");
+		goto out;
+	}
+	if (!mpop(&x))
+		goto out;
+	if (!mpop(&y)) {
+		mpush(x);
+		goto out;
+	}
+
+	hh = mpd_new(ctx); dx = mpd_new(ctx); pt = mpd_new(ctx);
+	fx = mpd_new(ctx); sum = mpd_new(ctx); abssum = mpd_new(ctx);
+	s = mpd_new(ctx); prev = mpd_new(ctx); prev2 = mpd_new(ctx);
+	scale = mpd_new(ctx); diff = mpd_new(ctx);
+
+	// the interval is y + hh (1 - u) ... x - hh (1 - u), for u in [0, 1)
+	mpd_sub(hh, x, y, ctx);
+	mpd_div(hh, hh, two, ctx);
+	mpd_copy(sum, zero, ctx);
+	mpd_copy(abssum, zero, ctx);
+
+	for (L = 0; L < TS_LEVELS; L++) {
+		lv = ts_nodes(L);
+		for (i = 0; i < lv->n; i++) {
+			mpd_mul(dx, hh, lv->node[2 * i], ctx);
+			for (side = 0; side < 2; side++) {
+				if (side == 0)
+					mpd_add(pt, y, dx, ctx);
+				else if (L == 0 && i == 0)
+					break;	// the middle only counts once
+				else
+					mpd_sub(pt, x, dx, ctx);
+
+				// no closer to the ends than they are
+				if (!mpd_cmp(pt, side ? x : y, ctx))
+					continue;
+				if (!eval_function(f, pt, fx))
+					goto fail;
+				mpd_mul(fx, fx, lv->node[2 * i + 1], ctx);
+				mpd_add(sum, sum, fx, ctx);
+				mpd_abs(fx, fx, ctx);
+				mpd_add(abssum, abssum, fx, ctx);
+			}
+		}
+
+		// s = sum * hh / 2^L,  and likewise for the scale
+		mpd_set_u64(dx, (uint64_t)1 << L, ctx);
+		mpd_div(dx, hh, dx, ctx);
+		mpd_mul(s, sum, dx, ctx);
+		mpd_mul(scale, abssum, dx, ctx);
+		mpd_abs(scale, scale, ctx);
+
+		if (L > 0) {
+			/* done if the change was small enough, or if the
+			 * number of good digits, which roughly doubles at
+			 * each level, is now enough.  */
+			if (mpd_iszero(scale))
+				break;
+			mpd_sub(diff, s, prev, ctx);
+			if (mpd_iszero(diff))
+				break;
+			d1 = rel_exponent(diff, scale);
+			if (d1 <= want)
+				break;
+			if (L > 1) {
+				mpd_sub(diff, s, prev2, ctx);
+				d2 = mpd_iszero(diff) ? 0 :
+					rel_exponent(diff, scale);
+				if (d1 < d2 && d2 < 0) {
+					est = d1 * d1 / d2;
+					if (est < 2 * d1)
+						est = 2 * d1;
+					if (est <= want)
+						break;
+				}
+			}
+		}
+		mpd_copy(prev2, prev, ctx);
+		mpd_copy(prev, s, ctx);
+	}
+	trace(EXEC, "integrate: %d levels\n", L + 1);
+	if (L == TS_LEVELS)
+		error("warning: integral may be inaccurate\n");
+
+	r = move_lastx(x);
+	mpd_del(move_lasty(y));
+	mpd_copy(r, s, ctx);
+	mpush(r);
+	ret = GOODOP;
+
+    fail:
+	if (ret != GOODOP) {
+		mpush(y);
+		mpush(x);
+	}
+	mpd_del(hh); mpd_del(dx); mpd_del(pt);
+	mpd_del(fx); mpd_del(sum); mpd_del(abssum);
+	mpd_del(s); mpd_del(prev); mpd_del(prev2);
+	mpd_del(scale); mpd_del(diff);
+    out:
+	if (f == &anon)
+		function_done(&anon);
+	return ret;
+}
+
+// ------------------------    saved state
+
+/* "save" writes a snapshot of the calculator to a file:  the mode
+ * and display settings, the configuration toggles, lastx, lasty, the
+ * off-stack value, the stack, the variables, and the constants (pi
+ * and e) that otherwise have to be calculated at startup.  Running
+ * "rca --state FILE" maps that file back in, instead of running the
+ * commands in $RCA_INIT.  Numbers are kept as raw mpdecimal data, so
+ * a state file is only good for the rca that wrote it, on the same
+ * kind of machine.  The version and the sizes are checked.  */
+
+#define STATE_MAGIC "rcastat"
+#define STATE_VERSION 1
+
+struct state_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t limbsize;	/* sizeof(mpd_uint_t) */
+	int32_t max_digits;
+	int32_t nints;
+	int32_t nstack;
+	int32_t nvars;
+	uint64_t size;		/* of the whole file */
+};
+
+/* each number is one of these, followed by its name (variables
+ * only), and then by its coefficient.  everything is padded to 8
+ * bytes.  */
+struct state_num {
+	int64_t exp;
+	int64_t digits;
+	int64_t len;		/* -1 if there's no number */
+	uint32_t flags;
+	uint32_t namelen;
+};
+
+/* the simple settings, in file order.  the float format, which is a
+ * string, is saved as an index into state_formats[].  */
+int *state_ints[] = {
+	&mode, &float_digits, &int_width, &autoprint, &digitseparators,
+	&rightalignment, &zerofill, &trig_degrees, &infix_mode,
+	&exit_on_error, &debug_enabled, &stack_mark,
+};
+#define NSTATEINTS ((int)(sizeof(state_ints)/sizeof(state_ints[0])))
+char *state_formats[] = { "automatic", "engineering", "fixed" };
+
+void *state_map;	/* the mapped file, until it's been used up */
+size_t state_size, state_off;
+char *state_path;
+struct state_header *state_hdr;
+boolean state_loaded;
+
+#define STATE_PAD(n) (((n) + 7) & ~(size_t)7)
+
+void
+state_fail(char *why)
+{
+	fprintf(stderr, "%s: %s: %s\n", progname, state_path, why);
+	exit(1);
+}
+
+void *
+state_take(size_t n)
 {
-	return shunting_yard(1);
-}
+	void *p;
 
-// ------------------------    variables
+	n = STATE_PAD(n);
+	if (n > state_size - state_off)
+		state_fail("state file is truncated");
+	p = (char *)state_map + state_off;
+	state_off += n;
+	return p;
+}
 
-opreturn
-assignment(void)
+/* map and check the file.  its contents are consumed later:  the
+ * constants by mpd_startup(), the rest by state_restore().  */
+void
+state_open(char *path)
+{
+	struct stat sb;
+	int fd;
+
+	state_path = path;
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) < 0)
+		state_fail(strerror(errno));
+	if ((size_t)sb.st_size < sizeof(struct state_header))
+		state_fail("not a state file");
+
+	state_size = (size_t)sb.st_size;
+	state_map = mmap(NULL, state_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (state_map == MAP_FAILED) {
+		state_map = 0;
+		state_fail(strerror(errno));
+	}
+
+	state_hdr = state_take(sizeof(struct state_header));
+	if (memcmp(state_hdr->magic, STATE_MAGIC, sizeof(STATE_MAGIC)))
+		state_fail("not a state file");
+	if (state_hdr->version != STATE_VERSION ||
+			state_hdr->limbsize != sizeof(mpd_uint_t) ||
+			state_hdr->nints != NSTATEINTS + 1)
+		state_fail("state file is from a different version of rca");
+	if (state_hdr->size != state_size ||
+			state_hdr->max_digits < 2 ||
+			state_hdr->nstack < 0 || state_hdr->nvars < 0 ||
+			state_hdr->nvars > NVAR-1)
+		state_fail("state file is damaged");
+
+	max_digits = state_hdr->max_digits;
+	state_loaded = TRUE;
+}
+
+/* fetch the next number, and its name if it has one.  *mp is null
+ * if the number was missing when the state was saved.  */
+void
+state_get_num(mpd_t **mp, char **namep)
 {
-	/* This gets decremented with every RPN token executed.  If a
-	 * variable is the very next token, we'll write to it instead
-	 * of read.  */
-	variable_write_enable = 2;
-	trace(EXEC,( " enabling assignment\n"));
-	return GOODOP;
-}
+	struct state_num *sn;
+	char *name;
+	void *data;
+	uint32_t status = 0;
+	mpd_t *m;
 
-typedef struct {
-    mpd_t *mpd;
-    char *name;
-} dynvar;
+	sn = state_take(sizeof(*sn));
+	name = state_take(sn->namelen);
+	if (namep)
+		*namep = sn->namelen ? strndup(name, sn->namelen) : 0;
 
-#define NVAR 50
-dynvar variables[NVAR];
+	*mp = 0;
+	if (sn->len < 0)
+		return;
 
-int
-comparevars(const void *a, const void *b)
+	if ((uint64_t)sn->len > (state_size - state_off) / sizeof(mpd_uint_t))
+		state_fail("state file is truncated");
+	if (!(sn->flags & MPD_SPECIAL) && (sn->len == 0 ||
+			sn->digits < 1 || sn->digits > sn->len * MPD_RDIGITS ||
+			sn->exp < MPD_MIN_EMIN - MPD_MAX_PREC + 1 ||
+			sn->exp > MPD_MAX_EMAX - sn->digits + 1))
+		state_fail("state file is damaged");
+	data = state_take((size_t)sn->len * sizeof(mpd_uint_t));
+
+	m = mpd_new(ctx);
+	if (!mpd_qresize(m, (mpd_ssize_t)sn->len, &status)) {
+		perror("rca: mpd_qresize failed");
+		exit(3);
+	}
+	memcpy(m->data, data, (size_t)sn->len * sizeof(mpd_uint_t));
+	m->len = (mpd_ssize_t)sn->len;
+	m->exp = (mpd_ssize_t)sn->exp;
+	mpd_set_flags(m, (uint8_t)(sn->flags & (MPD_NEG|MPD_SPECIAL)));
+
+	/* the coefficient has to agree with its digit count */
+	if (!mpd_isspecial(m)) {
+		mpd_ssize_t i;
+
+		for (i = 0; i < m->len; i++)
+			if (m->data[i] >= MPD_RADIX)
+				state_fail("state file is damaged");
+		if (m->len > 1 && m->data[m->len - 1] == 0)
+			state_fail("state file is damaged");
+		mpd_setdigits(m);
+		if (m->digits != (mpd_ssize_t)sn->digits)
+			state_fail("state file is damaged");
+	}
+	m->digits = (mpd_ssize_t)sn->digits;
+	*mp = m;
+}
+
+/* called from mpd_startup(), to avoid recalculating pi and e */
+boolean
+state_constants(void)
 {
-	dynvar *va = (dynvar *)a;
-	dynvar *vb = (dynvar *)b;
+	mpd_t *m[4];
+	int i;
 
-	return strcmp(va->name, vb->name);
+	if (!state_map)
+		return FALSE;
+
+	state_off = sizeof(struct state_header) +
+		STATE_PAD((size_t)state_hdr->nints * sizeof(int32_t));
+	for (i = 0; i < 4; i++) {
+		state_get_num(&m[i], 0);
+		if (!m[i])
+			state_fail("state file is damaged");
+	}
+	e = m[0];
+	pi = m[1];
+	pi_over_2 = m[2];
+	two_pi = m[3];
+	return TRUE;
 }
 
-opreturn
-clearvars(void)
+/* the settings are checked as the commands that set them would:
+ * anything else would only come from a damaged file */
+boolean
+state_ints_ok(int32_t *ints)
 {
-	dynvar *v;
+	int32_t v;
+	int i;
 
-	for (v = variables; v->name; v++) {
-		mpd_del(v->mpd);
-		v->mpd = 0;
-		free(v->name);
-		v->name = 0;
+	for (i = 0; i < NSTATEINTS; i++) {
+		v = ints[i];
+		if (state_ints[i] == &mode) {
+			if (!v || !strchr("FCDHOB", v))
+				return FALSE;
+		} else if (state_ints[i] == &float_digits) {
+			if (v < 0 || v > max_digits)
+				return FALSE;
+		} else if (state_ints[i] == &int_width) {
+			if (v < 2 || v > max_int_width)
+				return FALSE;
+		} else if (state_ints[i] == &autoprint) {
+			if (v < -1)
+				return FALSE;
+		} else if (state_ints[i] == &stack_mark) {
+			if (v < 0 || v > state_hdr->nstack)
+				return FALSE;
+		} else if (v != 0 && v != 1) {	// the rest are booleans
+			return FALSE;
+		}
 	}
-	return GOODOP;
+	return ints[i] >= 0 && ints[i] < 3;	// the float format
 }
 
-opreturn
-showvars(void)
+void
+state_restore(void)
 {
+	int32_t *ints;
+	mpd_t *m;
+	char *name;
 	dynvar *v;
+	int i;
 
-	if (!variables->name) {
-		p_printf(" <none>\n");
-		return GOODOP;
-	}
-	for (v = variables; v->name; v++)
-		/* count the variables */;
+	if (!state_map)
+		return;
 
-	qsort(variables, (size_t)(v - variables), sizeof(*v), comparevars);
+	state_get_num(&m, 0);
+	if (m) { mpd_copy(lastx, m, ctx); mpd_del(m); }
+	state_get_num(&m, 0);
+	if (m) { mpd_copy(lasty, m, ctx); mpd_del(m); }
+	state_get_num(&m, 0);
+	if (m) { mpd_copy(offstack, m, ctx); mpd_del(m); }
+
+	/* the stack was saved from the bottom up */
+	for (i = 0; i < state_hdr->nstack; i++) {
+		state_get_num(&m, 0);
+		if (!m)
+			state_fail("state file is damaged");
+		mpush(m);
+	}
 
-	int savealign = rightalignment;
-	rightalignment = 0;
-	for (v = variables; v->name; v++) {
-		p_printf(" %20s ", v->name);
-		print_n(v->mpd, mode, 0, 0);
+	for (i = 0; i < state_hdr->nvars; i++) {
+		state_get_num(&m, &name);
+		if (!m || !name || !(v = findvar(name)))
+			state_fail("state file is damaged");
+		mpd_del(v->mpd);
+		v->mpd = m;
+		free(name);
 	}
-	rightalignment = savealign;
 
-	return GOODOP;
+	/* settings go last, so the stack went in untouched by the mode */
+	ints = (int32_t *)((char *)state_map + sizeof(struct state_header));
+	if (!state_ints_ok(ints))
+		state_fail("state file is damaged");
+	for (i = 0; i < NSTATEINTS; i++)
+		*state_ints[i] = ints[i];
+	float_specifier = state_formats[ints[i]];
+	setup_integer_width(int_width);
+
+	munmap(state_map, state_size);
+	state_map = 0;
 }
 
-dynvar *
-findvar(char *name)
+void
+state_put_num(FILE *fp, const mpd_t *m, char *name)
 {
-	dynvar *v;
-	for (v = variables; v->name && v < variables + NVAR-1; v++) {
-		if (strcmp(name, v->name) == 0) {
-			return v;
-		}
+	static const char zeros[8];
+	struct state_num sn;
+
+	memset(&sn, 0, sizeof(sn));
+	sn.len = -1;
+	if (m) {
+		sn.exp = m->exp;
+		sn.digits = m->digits;
+		sn.len = m->len;
+		sn.flags = m->flags & (MPD_NEG|MPD_SPECIAL);
 	}
-	if (v < variables + NVAR-1) {
-		v->name = strdup(name);
-		v->mpd = mpd_new(ctx);
-		mpd_set_i64(v->mpd, 0, ctx);
-		return v;
+	if (name)
+		sn.namelen = (uint32_t)strlen(name);
+
+	fwrite(&sn, sizeof(sn), 1, fp);
+	if (name) {
+		fwrite(name, 1, sn.namelen, fp);
+		fwrite(zeros, 1, STATE_PAD(sn.namelen) - sn.namelen, fp);
 	}
-	return 0;
+	if (m)
+		fwrite(m->data, sizeof(mpd_uint_t), (size_t)m->len, fp);
 }
 
-int
-dynamic_var(token *t)
+opreturn
+savestate(void)
 {
+	struct state_header hdr;
+	int32_t ints[NSTATEINTS + 2];  // + 1 for the pad
+	struct num **bottomup, *s;
 	dynvar *v;
+	char *path;
+	FILE *fp;
+	int i;
 
-	v = findvar(t->valstr);
-	if (!v) {
-		error(" error: out of space for variables\n");
-		return 0;
+	path = getenv("RCA_STATE");
+	if (!path || !*path)
+		path = "rca.state";
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		error(" error: can't write %s: %s\n", path, strerror(errno));
+		return BADOP;
 	}
 
-	/* if we were preceded by '=', set our value */
-	if (variable_write_enable) {
-		mpd_t *x;
-		if (!mpeek(&x)) {
-			trace(EXEC, " nothing to assign\n");
-			return 0;
-		}
-		// trace(EXEC, " assigning %Lg to %s\n", a, v->name);
-		if (!v->mpd)
-			v->mpd  = mpd_new(ctx);
-		mpd_copy(v->mpd, x, ctx);
-	} else {
-		mpush_copy(v->mpd);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+	hdr.version = STATE_VERSION;
+	hdr.limbsize = sizeof(mpd_uint_t);
+	hdr.max_digits = max_digits;
+	hdr.nints = NSTATEINTS + 1;
+	hdr.nstack = stack_count;
+	for (v = variables; v->name; v++)
+		hdr.nvars++;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	memset(ints, 0, sizeof(ints));
+	for (i = 0; i < NSTATEINTS; i++)
+		ints[i] = *state_ints[i];
+	for (ints[i] = 0; ints[i] < 3; ints[i]++)
+		if (!strcmp(float_specifier, state_formats[ints[i]]))
+			break;
+	fwrite(ints, sizeof(int32_t), STATE_PAD((size_t)hdr.nints *
+			sizeof(int32_t)) / sizeof(int32_t), fp);
+
+	state_put_num(fp, e, 0);
+	state_put_num(fp, pi, 0);
+	state_put_num(fp, pi_over_2, 0);
+	state_put_num(fp, two_pi, 0);
+	state_put_num(fp, lastx, 0);
+	state_put_num(fp, lasty, 0);
+	state_put_num(fp, offstack, 0);
+
+	bottomup = (struct num **)safe_calloc((size_t)stack_count *
+						sizeof(*bottomup) + 1);
+	for (i = stack_count, s = stack; s; s = s->next)
+		bottomup[--i] = s;
+	for (i = 0; i < stack_count; i++)
+		state_put_num(fp, bottomup[i]->val->mpd, 0);
+	free(bottomup);
+
+	for (v = variables; v->name; v++)
+		state_put_num(fp, v->mpd, v->name);
+
+	/* now that the size is known, finish the header */
+	hdr.size = (uint64_t)ftell(fp);
+	rewind(fp);
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	if (ferror(fp) | fclose(fp)) {
+		error(" error: failed writing %s\n", path);
+		return BADOP;
 	}
-	return 1;
+
+	p_printf(" State saved to %s\n", path);
+	return GOODOP;
 }
 
 // ------------------------   configuration toggles
@@ -4650,6 +8800,45 @@ autop(void)
 	return GOODOP;
 }
 
+opreturn
+output_worker(int *style, int *other, char *name)
+{
+	mpd_t *m;
+	int64_t n;
+
+	if (!mpop(&m))
+		return BADOP;
+
+	if (!mpd_get_count(m, &n) || n < 0 || n > 2) {
+		mpush(m);
+		error(" error: %s output is 0 (off), 1 (formatted), "
+			"or 2 (full precision)\n", name);
+		return BADOP;
+	}
+	mpd_del(m);
+
+	*style = (int)n;
+	if (n)
+		*other = 0;
+
+	p_printf(" %s output is now %s\n", name,
+		n == 0 ? "off" : n == 1 ? "formatted" : "full precision");
+
+	return GOODOP;
+}
+
+opreturn
+json(void)
+{
+	return output_worker(&json_output, &csv_output, "JSON");
+}
+
+opreturn
+csv(void)
+{
+	return output_worker(&csv_output, &json_output, "CSV");
+}
+
 // ------------------------     user input support
 
 #if defined(USE_EDITLINE) || defined(USE_READLINE)
@@ -4747,49 +8936,144 @@ editor_line(char **ibp)
 
 #endif
 
-char *
-strremoveall(char *haystack, const char *needle)
+/* Clean up a line of input, in place, in one pass:  everything from
+ * a '#' on is a comment, and thousands separators and currency
+ * symbols are dropped.
+ *
+ * Eliminating the thousands separator from numbers, like
+ * "1,345,011", removes them from the entire line, which would be a
+ * problem except:  the only simple ascii separators ever used in
+ * locales are '.' and ','.  We don't ',' use anywhere else.  Removing
+ * '.' is safe, because if the separator is '.', then the decimal
+ * point isn't.  All the other separators are unicode sequences, which
+ * we also don't use.  So the command line won't be harmed by this
+ * removal.  Some locales use a space as a separator, but it's a
+ * "hard" space, represented as unicode.
+ *
+ * Same for currency symbols.  They're mostly unicode sequences or
+ * "$", which are safe to remove.  But some are plain ascii, or
+ * punctuation we need.  We checked earlier to be sure the currency
+ * symbol doesn't match in any of our commands.  */
+void
+no_comments(char *cp)
 {
-	size_t len = strlen(needle);
-
-	if (len > 0) {
-		char *p = haystack;
+	char *out = cp;
+	size_t seplen = strlen(thousands_sep);
+	size_t curlen = strlen(currency);
 
-		while ((p = strstr(p, needle)) != NULL)
-			memmove(p, p + len, strlen(p + len) + 1);
+	while (*cp && *cp != '#') {
+		if (seplen && *cp == thousands_sep[0] &&
+				!strncmp(cp, thousands_sep, seplen)) {
+			cp += seplen;
+			continue;
+		}
+		if (curlen && *cp == currency[0] &&
+				!strncmp(cp, currency, curlen)) {
+			cp += curlen;
+			continue;
+		}
+		*out++ = *cp++;
 	}
-	return haystack;
+	*out = '\0';
 }
 
+// ------------------------   "--proto" request/response protocol
+
+/* answer the current request:
+ *	<id> ok <x>
+ *	<id> error <x> <message>
+ * where x is the top of stack, at full precision, or "-" if the
+ * stack is empty.  */
 void
-no_comments(char *cp)
+proto_respond(void)
 {
-	char *ncp;
-
-	/* Eliminate comments */
-	if ((ncp = strchr(cp, '#')) != NULL)
-		*ncp = '\0';
-
-	/* Eliminate the thousands separator from numbers, like
-	 * "1,345,011".  This removes them from the entire line, which
-	 * would be a problem except:  the only simple ascii
-	 * separators ever used in locales are '.' and ','.  We don't
-	 * ',' use anywhere else.  Removing '.' is safe, because if
-	 * the separator is '.', then the decimal point isn't.  All
-	 * the other separators are unicode sequences, which we also
-	 * don't use.  So the command line won't be harmed by this
-	 * removal.  Some locales use a space as a separator, but it's
-	 * a "hard" space, represented as unicode.  */
-	if (thousands_sep[0])
-		strremoveall(cp, thousands_sep);
-
-	/* Same for currency symbols.  They're mostly unicode
-	 * sequences or "$", which are safe to remove.  But some are
-	 * plain ascii, or punctuation we need.  We checked earlier to
-	 * be sure the currency symbol doesn't match in any of our
-	 * commands.  */
-	if (currency[0])
-		strremoveall(cp, currency);
+	mpd_t *m;
+	char *x = NULL;
+
+	if (!proto_id)
+		return;
+
+	if (mpeek(&m))
+		x = mpd_to_sci(m, 0);
+
+	if (proto_error)
+		fprintf(proto_out, "%s error %s %s\n",
+			proto_id, x ? x : "-", proto_error);
+	else
+		fprintf(proto_out, "%s ok %s\n", proto_id, x ? x : "-");
+
+	mpd_free(x);
+	free(proto_id);
+	proto_id = NULL;
+	free(proto_error);
+	proto_error = NULL;
+}
+
+/* read the next request into *bufp, and split off its id.  input is
+ * read in large chunks, and output is only flushed when no complete
+ * request is left on hand, just before we'd wait for more.  so a
+ * client that writes many requests before reading gets its answers
+ * in just as few writes.  returns 0 at EOF.  */
+int
+proto_line(char **bufp, size_t *lenp)
+{
+	static char *ibuf;
+	static size_t isize, ilen, ipos;
+	char *nl, *p;
+	size_t len;
+	ssize_t n;
+
+	// a request that ended early (say, in a parse error) is owed
+	proto_respond();
+
+	for (;;) {
+		nl = ilen ? memchr(ibuf + ipos, '\n', ilen - ipos) : NULL;
+		if (!nl && ilen == isize && ipos == 0) {  // grow
+			isize = isize ? isize * 2 : 64 * 1024;
+			ibuf = realloc(ibuf, isize);
+			if (!ibuf) memory_failure();
+		}
+		if (!nl) {
+			// move the partial line down, and read more
+			memmove(ibuf, ibuf + ipos, ilen - ipos);
+			ilen -= ipos;
+			ipos = 0;
+			fflush(proto_out);
+			n = read(0, ibuf + ilen, isize - ilen);
+			if (n > 0) {
+				ilen += (size_t)n;
+				continue;
+			}
+			if (ilen == 0)
+				return 0;
+			nl = ibuf + ilen;  // a last line, with no newline
+			ilen++;
+		}
+
+		len = (size_t)(nl - (ibuf + ipos));
+		if (len + 1 > *lenp) {
+			*lenp = len + 1;
+			*bufp = realloc(*bufp, *lenp);
+			if (!*bufp) memory_failure();
+		}
+		memcpy(*bufp, ibuf + ipos, len);
+		(*bufp)[len] = '\0';
+		ipos += len + 1;
+		if (ipos >= ilen)
+			ipos = ilen = 0;
+
+		// the id is the first word.  blank lines are ignored.
+		p = *bufp;
+		while (isspace(*p))
+			p++;
+		if (!*p)
+			continue;
+		len = strcspn(p, " \t\r");
+		proto_id = strndup(p, len);
+		input_ptr = p + len;
+		no_comments(input_ptr);
+		return 1;
+	}
 }
 
 /* on return from fetch_line(), the global input_ptr is a string
@@ -4805,7 +9089,7 @@ fetch_line(void)
 	char *rca_init;
 
 	/* get commands from $RCA_INIT */
-	if (!tried_rca_init) {
+	if (!tried_rca_init && !state_loaded) {
 		tried_rca_init = TRUE;
 		rca_init = getenv("RCA_INIT");
 		if (rca_init) {
@@ -4851,6 +9135,12 @@ fetch_line(void)
 		}
 	}
 
+	if (proto_mode) {
+		if (!proto_line(&input_buf, &blen))
+			exitret();
+		return 1;
+	}
+
 	/* get an input line from editline or readline */
 	if (!editor_line(&input_buf)) {
 
@@ -4892,6 +9182,146 @@ size_t stralnum(char *s, char **endptr)
 	return (size_t)(ns - s);
 }
 
+/* scan the digits of a hex, octal, or binary number, with "bits"
+ * bits per digit, into m.  numbers too big for 64 bits are collected
+ * as limbs, and are only limited by the maximum integer width.
+ * returns a pointer to the first character past the digits.  */
+char *
+scan_radix(char *p, int bits, int sign, mpd_t *m)
+{
+	uint64_t l[MAX_LIMBS];
+	int nlimbs = 1;
+	int d;
+
+	memset(l, 0, sizeof(l));
+
+	for (;; p++) {
+		if (isdigit(*p))
+			d = *p - '0';
+		else if (bits == 4 && isxdigit(*p))
+			d = tolower(*p) - 'a' + 10;
+		else
+			break;
+		if (d >= (1 << bits))
+			break;
+
+		if (nlimbs == 1 && (l[0] >> (64 - bits)) == 0) {
+			l[0] = (l[0] << bits) | (uint64_t)d;
+		} else {
+			nlimbs = MAX_LIMBS;
+			limbs_shl(l, l, (uint64_t)bits, MAX_LIMBS);
+			l[0] |= (uint64_t)d;
+		}
+	}
+
+	if ((nlimbs == 1 || limbs_distance(l, MAX_LIMBS) != UINT64_MAX) &&
+			(int_width <= 64 || !(l[0] >> 63))) {
+		/* this is the historical conversion:  at 64 bits or
+		 * less, a full 64 bit value will appear negative */
+		mpd_set_i64(m, (int64_t)((ll_t)l[0] * sign), ctx);
+		return p;
+	}
+
+	/* in integer mode, the value will be masked to the word
+	 * width when pushed.  do it now, so it stays exact.  */
+	if (!floating_mode(mode))
+		limbs_mask(l, MAX_LIMBS, int_width);
+	mpd_set_limbs(m, l, MAX_LIMBS);
+	if (sign < 0)
+		mpd_minus(m, m, ctx);
+
+	return p;
+}
+
+/* scan a decimal number:  digits, with an optional (locale) decimal
+ * point, and an optional exponent, into m.  values with no more than
+ * 19 significant digits are built directly.  longer ones, or those
+ * with extreme exponents, are handed to mpd_set_string().  returns a
+ * pointer to the first character past the number, which is p itself
+ * if there's no number there.  */
+char *
+scan_decimal(char *p, int sign, mpd_t *m)
+{
+	static char *buf;
+	static size_t buflen;
+	boolean seen_dp = FALSE;
+	uint64_t coeff = 0;
+	int64_t exp = 0, e = 0;
+	int ndigits = 0, sigdigits = 0;
+	char *s = p, *q;
+	size_t len;
+
+	for (;;) {
+		if (isdigit(*s)) {
+			ndigits++;
+			if (sigdigits || *s != '0')
+				sigdigits++;
+			if (sigdigits <= 19)
+				coeff = coeff * 10 + (uint64_t)(*s - '0');
+			if (seen_dp)
+				exp--;
+			s++;
+		} else if (!seen_dp && match_dp(s)) {
+			seen_dp = TRUE;
+			s += decimal_pt_len;
+		} else {
+			break;
+		}
+	}
+	if (!ndigits)
+		return p;
+
+	if (*s == 'e' || *s == 'E') {
+		int esign = 1;
+
+		q = s + 1;
+		if (*q == '+' || *q == '-')
+			esign = (*q++ == '-') ? -1 : 1;
+		if (isdigit(*q)) {
+			while (isdigit(*q)) {
+				if (e < 1000000000000000LL)  // plenty
+					e = e * 10 + (*q - '0');
+				q++;
+			}
+			exp += esign * e;
+			s = q;
+		}
+	}
+
+	if (sigdigits <= 19 && sigdigits <= ctx->prec &&
+			e < 1000000000LL) {
+		mpd_set_u64(m, coeff, ctx);
+		m->exp = (mpd_ssize_t)exp;
+		if (sign < 0)
+			mpd_set_negative(m);
+		return s;
+	}
+
+	/* the slow way:  copy the number, with a '.' for the locale's
+	 * decimal point, so mpdecimal can read it.  */
+	len = (size_t)(s - p) + 2;
+	if (len > buflen) {
+		buflen = len + 64;
+		free(buf);
+		buf = safe_calloc(buflen);
+	}
+	q = buf;
+	if (sign < 0)
+		*q++ = '-';
+	for (char *r = p; r < s; ) {
+		if (match_dp(r)) {
+			*q++ = '.';
+			r += decimal_pt_len;
+		} else {
+			*q++ = *r++;
+		}
+	}
+	*q = '\0';
+	mpd_set_string(m, buf, ctx);
+
+	return s;
+}
+
 /* parse_token() figures out what's in the text pointed to by p., and
  * returns what it finds, in the return token t.  nextp, if non-null, is
  * set to where processing should continue */
@@ -4929,75 +9359,84 @@ parse_token(char *p, token *t, char **nextp, int whichparse)
 
 	if (*p == '0' && (*(p + 1) == 'x' || *(p + 1) == 'X')) {
 		// hex, leading "0x"
-		unsigned long long u = strtoull(p, &np, 16);
+		t->mpd = mpd_new_inline();
+		np = scan_radix(p + 2, 4, sign, t->mpd);
 
 		/* be strict about what comes next */
-		if (isalnum(*np))
+		if (np == p + 2 || isalnum(*np)) {
+			mpd_del(t->mpd);
+			t->mpd = 0;
 			goto unknown;
+		}
 
 		t->type = NUMERIC;
 		t->imode = 'H';
-		t->valstr = strndup(p,(size_t)(np - p));
-		t->mpd = mpd_new(ctx);
-		mpd_set_i64(t->mpd, (int64_t)((ll_t)u * sign), ctx);
+		t->valstr = scratch_strndup(p, (size_t)(np - p));
 
 	} else if (*p == '0' && (*(p + 1) == 'b' || *(p + 1) == 'B')) {
 		// binary, leading "0b"
 		p += 2;
-		unsigned long long u = strtoull(p, &np, 2);
+		t->mpd = mpd_new_inline();
+		np = scan_radix(p, 1, sign, t->mpd);
 
 		/* be strict about what comes next */
-		if (np == p || isalnum(*np))
+		if (np == p || isalnum(*np)) {
+			mpd_del(t->mpd);
+			t->mpd = 0;
 			goto unknown;
+		}
 
 		t->type = NUMERIC;
 		t->imode = 'B';
-		t->valstr = strndup(p,(size_t)(np -p));
-		t->mpd = mpd_new(ctx);
-		mpd_set_i64(t->mpd, (int64_t)((ll_t)u * sign), ctx);
+		t->valstr = scratch_strndup(p, (size_t)(np -p));
 
 	} else if (*p == '0' && (*(p + 1) == 'o' || *(p + 1) == 'O')) {
 		// octal, leading "0o"
 		p += 2;
-		unsigned long long u = strtoull(p, &np, 8);
+		t->mpd = mpd_new_inline();
+		np = scan_radix(p, 3, sign, t->mpd);
 
 		/* be strict about what comes next */
-		if (np == p || isalnum(*np))
+		if (np == p || isalnum(*np)) {
+			mpd_del(t->mpd);
+			t->mpd = 0;
 			goto unknown;
+		}
 
 		t->type = NUMERIC;
 		t->imode = 'O';
-		t->valstr = strndup(p,(size_t)(np -p));
-		t->mpd = mpd_new(ctx);
-		mpd_set_i64(t->mpd, (int64_t)((ll_t)u * sign), ctx);
+		t->valstr = scratch_strndup(p, (size_t)(np -p));
 
 	} else if (isdigit(*p) || match_dp(p)) {
 		// decimal
-
-		/* parse the decimal, to find its end.  we don't want
-		 * the double, we just need the string */
-		(void)strtold(p, &np);
+		t->mpd = mpd_new_inline();
+		np = scan_decimal(p, sign, t->mpd);
 
 		/* don't be strict about what comes next.  mistakes are
 		 * less likely when entering decimal. this makes 3digits
 		 *  or 18bits legal */
-		if (p == np)
+		if (p == np) {
+			mpd_del(t->mpd);
+			t->mpd = 0;
 			goto unknown;
+		}
 
 		if (sign < 0)
 			p--;    // cover your eyes.  really.
 
 		t->type = NUMERIC;
 		t->imode = 'D';
-		t->valstr = strndup(p,(size_t)(np -p));
-		t->mpd = mpd_new(ctx);
-		mpd_set_string(t->mpd, t->valstr, ctx);
+
+		/* the text is only needed for messages about infix
+		 * expressions, and for tracing */
+		if (whichparse == INFIX || infix_mode || tracing)
+			t->valstr = scratch_strndup(p, (size_t)(np -p));
 
 	} else if (*p == '_' && isalnum(*(p+1))) {
 		// variable
 		n = stralnum(p, &np);
 		t->type = VARIABLE;
-		t->valstr = strndup(p,n);
+		t->valstr = scratch_strndup(p, n);
 
 	} else {
 
@@ -5028,7 +9467,7 @@ parse_token(char *p, token *t, char **nextp, int whichparse)
 			error(" error: illegal character in input\n");
 			t->str = p;
 			t->type = UNKNOWN;
-			if (nextp) *nextp = np;
+			if (nextp) *nextp = p + 1;
 			return 0;
 		}
 
@@ -5059,13 +9498,17 @@ parse_token(char *p, token *t, char **nextp, int whichparse)
 			}
 			op++;
 		}
-		if (!op->name) {
+		if (!op->name && (op = find_function(p, n))) {
+			np = p + n;
+			t->oper = op;
+			t->type = (op->operands == Sym) ? SYMBOLIC : OP;
+		} else if (!op || !op->name) {
 		unknown:
 			error(" error: unrecognized input '%s'\n",
 				strtok(p, " \t\n"));
 			t->str = p;
 			t->type = UNKNOWN;
-			if (nextp) *nextp = np;
+			if (nextp) *nextp = p + 1;
 			return 0;
 		}
 	}
@@ -5153,6 +9596,8 @@ struct config {
 	{ "autoprint",		c_int, &autoprint },
 	{ "separators",		c_int, &digitseparators },
 	{ "rightalign",		c_int, &rightalignment },
+	{ "json",		c_int, &json_output },
+	{ "csv",		c_int, &csv_output },
 	{ "zerofill",		c_int, &zerofill },
 	{ "degrees",		c_int, &trig_degrees },
 	{ "infix",		c_int, &infix_mode },
@@ -5741,6 +10186,11 @@ struct oper opers[] = {
 	{"variables", showvars, 0 },
 	{"vars", showvars, "Show the current list of variables" },
 	{"clearvariables", clearvars, "Discard all variables" },
+	{"define", define,	"Define a function:  \"define hyp _a _b (sqrt(_a*_a + _b*_b))\"" },
+	{"functions", showfunctions, "Show the user defined functions" },
+	{"solve", solve,	"Find where a function is 0, between y and x:  \"1 2 solve _x (_x*_x - 2)\"", Auto },
+	{"integrate", integrate, "Integrate a function from y to x:  \"0 1 integrate _x (4/(1 + _x*_x))\"", Auto },
+	{"save", savestate,	"Save state to $RCA_STATE (or rca.state)" },
 	{""},
     {"Variadic"},
      {" (use whole stack, or to mark, if set)"},
@@ -5748,6 +10198,11 @@ struct oper opers[] = {
 	{"sum", sum,		0, Auto },
 	{"avg", avg,		0, Auto },
 	{"stddev", stddev,	"Total, mean, and standard deviation of entries", Auto },
+	{"min", smallest,	0, Auto },
+	{"max", largest,	0, Auto },
+	{"median", median,	"Smallest, largest, and median of entries", Auto },
+	{"percentile", percentile, "The x'th percentile of the other entries", Auto },
+	{"percentiles", percentiles, "x percentiles (pushed before x) of the other entries", Auto },
 	{"snapshot", snapshot,	"Saves copy of selected entries", Auto },
 	{"restore", restore,	"Push a copy of the snapshot, set mark", Auto },
 	{"clearsnapshot", clearsnapshot, "Discard snapshot" },
@@ -5759,6 +10214,11 @@ struct oper opers[] = {
 	{"dup", enter,		"Push (a duplicate of) x", Auto },
 	{"exch", exchange,	0, Auto },
 	{"swap", exchange,	"Exchange x and y", Auto },
+	{"undo", undo,		0, Auto },
+	{"redo", redo,		"Undo (or redo) a line's changes to the stack", Auto },
+	{"sort", sort,		0, Auto },
+	{"rsort", rsort,	"Sort entries, largest (or smallest) on top", Auto },
+	{"uniq", uniq,		"Remove adjacent duplicate entries", Auto },
 	{""},
     {"Other"},
 	{"(", open_paren,	0, 0, 32 },
@@ -5803,12 +10263,16 @@ struct oper opers[] = {
 	{"degrees", use_degrees, "Toggle trig functions: degrees (1) or radians (0)" },
 	{"separators", separators, 0, Auto },
 	{"sep", separators,	"Toggle numeric separators on/off (0/1)", Auto },
+	{"json", json,		0 },
+	{"csv", csv,		"Print as JSON or CSV: off, formatted, full (0/1/2)" },
 	{"mode", modeinfo,	"Display current mode parameters" },
 	{"infix", infixmode,	"Toggle running mainly in infix, or in RPN" },
 	{""},
     {"Debug support", 0, 0, 0, 0, 'D'}, // hidden until "1 debug"
 	{"tracing", tracelevel,	"Set tracing level", 0, 0, 'D'},
 	{"commands", commands,	"Show raw command table", 0, 0, 'D'},
+	{"cachestats", cachestats, "Show transcendental cache hits and misses", 0, 0, 'D'},
+	{"allocstats", allocstats, "Show memory pool and scratch usage", 0, 0, 'D'},
 	{"nan", push_nan,	0, Sym, 0, 'D'},
 	{"inf", push_inf,	"Push invalid value nan, or inf", Sym, 0, 'D'},
 	{"", 0, 0, 0, 0, 'D'},
@@ -5853,6 +10317,7 @@ do_autoprint(token *pt)
 
 	case SYMBOLIC:
 	case VARIABLE:
+	case TEMPLOAD:
 		break;
 
 	case NUMERIC:
@@ -5880,21 +10345,57 @@ main(int argc, char *argv[])
 	token *pt = &prevtok;
 
 	pt->type = UNKNOWN;
-	mpd_startup();
 
 	char *pn = strrchr(argv[0], '/');
 	progname = pn ? (pn + 1) : argv[0];
 
+	pool_install();  // before anything is allocated by mpdecimal
+
+	/* a saved state replaces $RCA_INIT, and must be set up before
+	 * anything else.  we hide its arguments from fetch_line().  */
+	if (argc > 1 && strcmp(argv[1], "--state") == 0) {
+		if (argc < 3)
+			usage();
+		state_open(argv[2]);
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc > 1 && strcmp(argv[1], "--proto") == 0) {
+		/* responses get their own stream.  anything a command
+		 * prints directly (e.g., "help") is discarded.  */
+		proto_mode = TRUE;
+		proto_out = fdopen(dup(fileno(stdout)), "w");
+		if (!proto_out || !freopen("/dev/null", "w", stdout)) {
+			perror("rca: --proto");
+			exit(1);
+		}
+		setvbuf(proto_out, NULL, _IOFBF, 64 * 1024);
+		argv[1] = argv[0];
+		argv++;
+		argc--;
+		atexit(proto_respond);	// in case of "quit"
+	}
+
+	mpd_startup();
+
 	/* fetch_line() will process args as if they were input as commands */
 	g_argc = argc;
 	g_argv = argv;
 
 	locale_init();
 
+	/* output going to a file or pipe (perhaps a very large stack
+	 * listing) is written in big chunks */
+	if (!isatty(fileno(stdout)))
+		setvbuf(stdout, NULL, _IOFBF, 64 * 1024);
+
 	setup_integer_width(0);
 
 	config_read_defaults();
 
+	state_restore();
+
 	/* we simply loop forever, either pushing operands or
 	 * executing operators.  the special end-of-line token lets us
 	 * do reasonable autoprinting, if the last thing on the line
@@ -5902,11 +10403,16 @@ main(int argc, char *argv[])
 	 */
 	while (1) {
 
-		/* use up tokens created by infix processing first */
+		/* run any compiled infix expression first */
+		if (program.len) {
+			run_program(pt);
+			continue;
+		}
+
+		/* then use up the tokens it left behind */
 		token *tt;
 		if ((tt = tpop(&infix_rpn_queue))) {
 			tok = *tt;
-			free(tt);
 			freeze_lastx();
 		} else { /* otherwise get tokens from input as usual */
 			if (!read_token(&tok, RPN))
@@ -5937,26 +10443,11 @@ main(int argc, char *argv[])
 			// trace(EXEC,  " numeric %s\n", t->valstr);
 			trace_mpd(EXEC, "numeric", t->mpd);
 			mpush(t->mpd);
-			if (!tracing) {
-				/* we can't see var names and numbers
-				 * if we don't loosen the rules while
-				 * debugging */
-				free(t->valstr);
-				t->valstr = 0;
-			} else {
-				trace(0xff, "\nWarning:  expect leak from main/"
-					"read_token/parse_token/strndup\n\n");
-			}
 			valgrind("main numeric");
 			break;
 		case VARIABLE:
 			trace(EXEC, " variable %s\n", t->valstr);
 			dynamic_var(t);
-			if (!tracing) {
-				/* see above */
-				free(t->valstr);
-				t->valstr = 0;
-			}
 			valgrind("main variable");
 			break;
 		case SYMBOLIC:
@@ -5967,12 +10458,20 @@ main(int argc, char *argv[])
 			else
 				pending_clear();
 			valgrind("pre main op (or symbolic)");
+			invoked_oper = t->oper;
 			(t->oper->func) ();
 			valgrind("post main op (or symbolic)");
 			break;
 		case EOL:
-			do_autoprint(pt);
-			pending_show();
+			if (proto_mode) {
+				pending_clear();
+				proto_respond();
+			} else {
+				do_autoprint(pt);
+				pending_show();
+			}
+			checkpoint();
+			scratch_reset();
 			valgrind("main eol");
 			break;
 		default: